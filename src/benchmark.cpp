@@ -0,0 +1,554 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+
+using namespace BenchmarkConstants;
+
+SizeDistribution::SizeDistribution(const std::vector<Range>& ranges) :
+	ranges(ranges)
+{
+	std::vector<double> weights;
+	for (auto& range : ranges)
+		weights.push_back(range.weight);
+	pick = std::discrete_distribution<int>(weights.begin(), weights.end());
+}
+
+size_t SizeDistribution::operator()(std::mt19937_64& generator)
+{
+	const Range& range = ranges[pick(generator)];
+	std::uniform_real_distribution<double> exponent(std::log((double)range.from), std::log((double)range.to + 1));
+	return std::min(range.to, (size_t)std::exp(exponent(generator)));
+}
+
+SizeDistribution SizeDistribution::realistic()
+{
+	return SizeDistribution({
+		{ 8, 64, 45 },
+		{ 65, 256, 30 },
+		{ 257, 1 << 10, 13 },
+		{ (1 << 10) + 1, 8 << 10, 8 },
+		{ (8 << 10) + 1, 64 << 10, 3 },
+		{ (64 << 10) + 1, 256 << 10, 0.9 },
+		{ (256 << 10) + 1, 8 << 20, 0.1 },
+	});
+}
+
+SizeDistribution SizeDistribution::uniform(size_t from, size_t to)
+{
+	return SizeDistribution({ { from, to, 1 } });
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+	int bucket;
+	if (ns < (1 << HISTOGRAM_SUB_BITS))
+		bucket = (int)ns;
+	else
+	{
+		int exponent = Platform::log2Floor(ns);
+		int sub = (int)(ns >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+		bucket = ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) | sub;
+	}
+	counts[bucket]++;
+	total++;
+	maxNs = std::max(maxNs, ns);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts[i] += other.counts[i];
+	total += other.total;
+	maxNs = std::max(maxNs, other.maxNs);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	uint64_t rank = (uint64_t)std::ceil(p * total);
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+	{
+		seen += counts[bucket];
+		if (seen >= rank && seen > 0)
+		{
+			if (bucket < (1 << HISTOGRAM_SUB_BITS))
+				return bucket;
+			int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+			int sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+			return ((uint64_t)((1 << HISTOGRAM_SUB_BITS) | sub)) << (exponent - HISTOGRAM_SUB_BITS);
+		}
+	}
+	return maxNs;
+}
+
+namespace
+{
+	struct LiveObject
+	{
+		uint64_t deathTime;
+		void* ptr;
+		size_t size;
+		bool operator>(const LiveObject& other) const { return deathTime > other.deathTime; }
+	};
+
+	// objects handed over to a thread for it to free
+	struct Inbox
+	{
+		std::mutex mutex;
+		std::vector<LiveObject> objects;
+	};
+
+	struct Run
+	{
+		MemoryManager* const manager;
+		const WorkloadConfig& config;
+		const int threads;
+		std::vector<Inbox> inboxes;
+		std::atomic<int64_t> liveBytes{ 0 };
+		std::atomic<size_t> peakLiveBytes{ 0 };
+		std::atomic<size_t> peakRss{ 0 };
+		std::atomic<size_t> errors{ 0 };
+		Run(MemoryManager* manager, const WorkloadConfig& config, int threads) :
+			manager(manager), config(config), threads(threads), inboxes(threads) {}
+	};
+
+	uint64_t nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void updateMax(std::atomic<size_t>& peak, size_t value)
+	{
+		size_t prev = peak.load(std::memory_order_relaxed);
+		while (prev < value && !peak.compare_exchange_weak(prev, value, std::memory_order_relaxed));
+	}
+
+	unsigned char pattern(void* ptr)
+	{
+		return (unsigned char)((size_t)ptr >> 4);
+	}
+
+	class Worker
+	{
+		Run& run;
+		const int index;
+		std::mt19937_64 generator;
+		SizeDistribution sizes;
+		std::priority_queue<LiveObject, std::vector<LiveObject>, std::greater<LiveObject>> heap;
+		int64_t liveDelta = 0;
+	public:
+		LatencyHistogram allocateLatency;
+		LatencyHistogram freeLatency;
+
+		Worker(Run& run, int index, int seed) :
+			run(run), index(index), generator((uint64_t)seed * 1'000'003 + index), sizes(run.config.sizes) {}
+
+		void operator()()
+		{
+			const WorkloadConfig& config = run.config;
+			const uint64_t operations = config.operations / run.threads;
+			std::uniform_real_distribution<double> unit(0, 1);
+			std::exponential_distribution<double> shortLifetime(1 / config.meanShortLifetime);
+			std::exponential_distribution<double> mediumLifetime(1 / config.meanMediumLifetime);
+			std::exponential_distribution<double> longLifetime(8.0 / std::max<uint64_t>(operations, 8));
+
+			for (uint64_t time = 0; time < operations; time++)
+			{
+				while (!heap.empty() && heap.top().deathTime <= time)
+				{
+					release(heap.top());
+					heap.pop();
+				}
+
+				LiveObject object{ 0, nullptr, sizes(generator) };
+				uint64_t start = nowNs();
+				object.ptr = run.manager != nullptr ? run.manager->allocate(object.size) : std::malloc(object.size);
+				allocateLatency.record(nowNs() - start);
+				// objects are written as a program would, which also commits their pages
+				std::memset(object.ptr, pattern(object.ptr), object.size);
+				liveDelta += object.size;
+
+				if (run.threads > 1 && unit(generator) < config.crossThreadShare)
+				{
+					Inbox& inbox = run.inboxes[(index + 1) % run.threads];
+					std::lock_guard<std::mutex> lock(inbox.mutex);
+					inbox.objects.push_back(object);
+				}
+				else
+				{
+					double kind = unit(generator);
+					double lifetime = kind < config.shortShare ? shortLifetime(generator)
+						: kind < config.shortShare + config.mediumShare ? mediumLifetime(generator)
+						: longLifetime(generator);
+					object.deathTime = time + 1 + (uint64_t)lifetime;
+					heap.push(object);
+				}
+
+				if (time % INBOX_INTERVAL == 0)
+					drainInbox();
+				if (time % SAMPLE_INTERVAL == 0)
+					sample();
+			}
+			sample();
+			while (!heap.empty())
+			{
+				release(heap.top());
+				heap.pop();
+			}
+			drainInbox();
+			sample();
+		}
+
+		void drainInbox()
+		{
+			std::vector<LiveObject> objects;
+			{
+				Inbox& inbox = run.inboxes[index];
+				std::lock_guard<std::mutex> lock(inbox.mutex);
+				objects.swap(inbox.objects);
+			}
+			for (auto& object : objects)
+				release(object);
+		}
+
+	private:
+		void release(const LiveObject& object)
+		{
+			if (run.config.verify)
+			{
+				const unsigned char* bytes = (const unsigned char*)object.ptr;
+				for (size_t i = 0; i < object.size; i++)
+				{
+					if (bytes[i] != pattern(object.ptr))
+					{
+						run.errors++;
+						break;
+					}
+				}
+			}
+			uint64_t start = nowNs();
+			if (run.manager != nullptr)
+				run.manager->free(object.ptr);
+			else
+				std::free(object.ptr);
+			freeLatency.record(nowNs() - start);
+			liveDelta -= object.size;
+		}
+
+		void sample()
+		{
+			int64_t live = run.liveBytes.fetch_add(liveDelta) + liveDelta;
+			liveDelta = 0;
+			updateMax(run.peakLiveBytes, (size_t)std::max<int64_t>(live, 0));
+			updateMax(run.peakRss, Platform::residentBytes());
+		}
+	};
+}
+
+BenchmarkResult runWorkload(MemoryManager* manager, const WorkloadConfig& config, int threads, int seed)
+{
+	Run run(manager, config, threads);
+	const size_t startRss = Platform::residentBytes();
+	std::vector<Worker> workers;
+	workers.reserve(threads);
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(run, i, seed);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (int i = 0; i < threads; i++)
+		pool.emplace_back(std::ref(workers[i]));
+	for (auto& thread : pool)
+		thread.join();
+	// objects handed over to threads that had already finished
+	for (auto& worker : workers)
+		worker.drainInbox();
+
+	BenchmarkResult ret;
+	ret.elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	for (auto& worker : workers)
+	{
+		ret.allocateLatency.merge(worker.allocateLatency);
+		ret.freeLatency.merge(worker.freeLatency);
+	}
+	ret.peakLiveBytes = run.peakLiveBytes;
+	ret.peakRssBytes = run.peakRss > startRss ? run.peakRss - startRss : 0;
+	ret.errors = run.errors;
+	return ret;
+}
+
+void printResult(const std::string& name, const BenchmarkResult& result)
+{
+	auto printLatency = [](const char* label, const LatencyHistogram& histogram) {
+		std::cout << "  " << label << " ns: p50 = " << histogram.percentile(0.5) << ", p99 = " << histogram.percentile(0.99)
+			<< ", p99.9 = " << histogram.percentile(0.999) << ", max = " << histogram.max() << std::endl;
+	};
+	double seconds = std::max<uint64_t>(result.elapsedMs, 1) / 1000.0;
+	std::cout << name << ": " << result.elapsedMs << "ms, " << std::fixed << std::setprecision(2)
+		<< result.allocateLatency.count() / seconds / 1e6 << "M allocations/s" << std::endl;
+	printLatency("allocate", result.allocateLatency);
+	printLatency("free", result.freeLatency);
+	std::cout << "  peak live = " << result.peakLiveBytes / (1 << 20) << "MiB, peak RSS growth = " << result.peakRssBytes / (1 << 20)
+		<< "MiB, RSS / live = " << (double)result.peakRssBytes / std::max<size_t>(result.peakLiveBytes, 1) << std::endl;
+	std::cout.unsetf(std::ios::fixed);
+	std::cout << std::setprecision(6);
+	if (result.errors > 0)
+		std::cerr << "wrong: " << result.errors << " corrupted blocks" << std::endl;
+}
+
+ReplayPlan planReplay(const Trace& trace)
+{
+	struct Ref
+	{
+		uint64_t timestamp;
+		// among events at one timestamp allocations go first, as a block is stamped only once it is handed out
+		bool isFree;
+		uint32_t thread;
+		size_t index;
+	};
+	ReplayPlan plan;
+	std::vector<Ref> refs;
+	plan.threads.resize(trace.threads.size());
+	for (uint32_t thread = 0; thread < trace.threads.size(); thread++)
+	{
+		const std::vector<TraceEvent>& events = trace.threads[thread];
+		plan.threads[thread].resize(events.size());
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			const TraceOp op = events[i].op();
+			refs.push_back(Ref{ events[i].timestamp, op == TraceOp::FREE || op == TraceOp::FREE_SIZED, thread, i });
+		}
+	}
+	std::stable_sort(refs.begin(), refs.end(), [](const Ref& a, const Ref& b) {
+		return a.timestamp != b.timestamp ? a.timestamp < b.timestamp : a.isFree < b.isFree;
+	});
+
+	// live blocks by address, oldest first
+	std::unordered_map<uint64_t, std::deque<int64_t>> live;
+	auto take = [&](uint64_t id) -> int64_t {
+		auto found = live.find(id);
+		if (found == live.end())
+		{
+			plan.unmatched++;
+			return -1;
+		}
+		int64_t block = found->second.front();
+		found->second.pop_front();
+		if (found->second.empty())
+			live.erase(found);
+		return block;
+	};
+	for (const Ref& ref : refs)
+	{
+		const TraceEvent& event = trace.threads[ref.thread][ref.index];
+		ReplayPlan::Step& step = plan.threads[ref.thread][ref.index];
+		step.op = event.op();
+		step.size = event.size();
+		step.alignment = step.op == TraceOp::ALLOCATE_ALIGNED ? (size_t)event.argument : 0;
+		step.block = -1;
+		step.source = -1;
+		if (ref.isFree)
+		{
+			step.source = take(event.id);
+			continue;
+		}
+		if (step.op == TraceOp::REALLOCATE && event.argument != 0)
+			step.source = take(event.argument);
+		if (event.id != 0)
+		{
+			step.block = (int64_t)plan.blockSizes.size();
+			plan.blockSizes.push_back(step.size);
+			live[event.id].push_back(step.block);
+		}
+	}
+	for (auto& blocks : live)
+		plan.unfreed.insert(plan.unfreed.end(), blocks.second.begin(), blocks.second.end());
+	return plan;
+}
+
+namespace
+{
+	// stands for a block allocated as nullptr, so that its slot still shows it allocated
+	char nullBlock;
+
+	struct Replay
+	{
+		MemoryManager* const manager;
+		CustomMemoryManager* const customManager;
+		const ReplayPlan& plan;
+		std::unique_ptr<std::atomic<void*>[]> blocks;
+		std::atomic<int64_t> liveBytes{ 0 };
+		std::atomic<size_t> peakLiveBytes{ 0 };
+		std::atomic<size_t> peakRss{ 0 };
+		Replay(MemoryManager* manager, const ReplayPlan& plan) :
+			manager(manager), customManager(dynamic_cast<CustomMemoryManager*>(manager)), plan(plan),
+			blocks(new std::atomic<void*>[plan.blockSizes.size()]())
+		{
+		}
+
+		void* perform(const ReplayPlan::Step& step, void* source)
+		{
+			switch (step.op)
+			{
+			case TraceOp::ALLOCATE:
+				return manager != nullptr ? manager->allocate(step.size) : std::malloc(step.size);
+			case TraceOp::ALLOCATE_ALIGNED:
+				if (customManager != nullptr)
+					return customManager->allocateAligned(step.size, step.alignment);
+				if (manager != nullptr)
+					return manager->allocate(step.size);
+				return alignedMalloc(step.size, step.alignment);
+			case TraceOp::FREE:
+				release(source);
+				return nullptr;
+			case TraceOp::FREE_SIZED:
+				if (manager != nullptr)
+					manager->free(source, step.size);
+				else
+					std::free(source);
+				return nullptr;
+			case TraceOp::REALLOCATE:
+				return manager != nullptr ? manager->reallocate(source, step.size) : std::realloc(source, step.size);
+			}
+			return nullptr;
+		}
+
+		void release(void* ptr)
+		{
+			if (manager != nullptr)
+				manager->free(ptr);
+			else
+				std::free(ptr);
+		}
+
+	private:
+		static void* alignedMalloc(size_t size, size_t alignment)
+		{
+#ifdef _WIN32
+			// no aligned allocation there that free takes back
+			(void)alignment;
+			return std::malloc(size);
+#else
+			void* ptr = nullptr;
+			return posix_memalign(&ptr, std::max(alignment, sizeof(void*)), size) == 0 ? ptr : nullptr;
+#endif
+		}
+	};
+
+	class Replayer
+	{
+		Replay& replay;
+		const std::vector<ReplayPlan::Step>& steps;
+		int64_t liveDelta = 0;
+	public:
+		LatencyHistogram allocateLatency;
+		LatencyHistogram freeLatency;
+
+		Replayer(Replay& replay, const std::vector<ReplayPlan::Step>& steps) :
+			replay(replay), steps(steps) {}
+
+		void operator()()
+		{
+			for (size_t i = 0; i < steps.size(); i++)
+			{
+				const ReplayPlan::Step& step = steps[i];
+				const bool isFree = step.op == TraceOp::FREE || step.op == TraceOp::FREE_SIZED;
+				void* source = nullptr;
+				if (step.source >= 0)
+				{
+					while ((source = replay.blocks[step.source].load(std::memory_order_acquire)) == nullptr)
+						std::this_thread::yield();
+					if (source == &nullBlock)
+						source = nullptr;
+					liveDelta -= replay.plan.blockSizes[step.source];
+				}
+				else if (isFree)
+					continue;
+
+				uint64_t start = nowNs();
+				void* ptr = replay.perform(step, source);
+				uint64_t elapsed = nowNs() - start;
+				if (isFree)
+					freeLatency.record(elapsed);
+				else
+				{
+					allocateLatency.record(elapsed);
+					// written as the program would have, which also commits the pages
+					if (ptr != nullptr)
+						std::memset(ptr, 0, step.size);
+					if (step.block >= 0)
+					{
+						replay.blocks[step.block].store(ptr != nullptr ? ptr : &nullBlock, std::memory_order_release);
+						liveDelta += step.size;
+					}
+					else if (ptr != nullptr)
+					{
+						// the recorded allocation failed
+						replay.release(ptr);
+					}
+				}
+				if (i % SAMPLE_INTERVAL == 0)
+					sample();
+			}
+			sample();
+		}
+
+	private:
+		void sample()
+		{
+			int64_t live = replay.liveBytes.fetch_add(liveDelta) + liveDelta;
+			liveDelta = 0;
+			updateMax(replay.peakLiveBytes, (size_t)std::max<int64_t>(live, 0));
+			updateMax(replay.peakRss, Platform::residentBytes());
+		}
+	};
+}
+
+BenchmarkResult replayTrace(MemoryManager* manager, const ReplayPlan& plan)
+{
+	Replay replay(manager, plan);
+	const size_t startRss = Platform::residentBytes();
+	std::vector<Replayer> replayers;
+	replayers.reserve(plan.threads.size());
+	for (auto& steps : plan.threads)
+		replayers.emplace_back(replay, steps);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (auto& replayer : replayers)
+		pool.emplace_back(std::ref(replayer));
+	for (auto& thread : pool)
+		thread.join();
+
+	BenchmarkResult ret;
+	ret.elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	for (auto& replayer : replayers)
+	{
+		ret.allocateLatency.merge(replayer.allocateLatency);
+		ret.freeLatency.merge(replayer.freeLatency);
+	}
+	ret.peakLiveBytes = replay.peakLiveBytes;
+	ret.peakRssBytes = replay.peakRss > startRss ? replay.peakRss - startRss : 0;
+	// the blocks still live when the recording ended
+	for (int64_t block : plan.unfreed)
+	{
+		void* ptr = replay.blocks[block].load(std::memory_order_relaxed);
+		if (ptr != &nullBlock)
+			replay.release(ptr);
+	}
+	return ret;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+// benchmark harness
+// mixed-size workloads with object lifetimes and cross-thread frees,
+// per-operation latency percentiles, RSS and fragmentation
+// and the replay of recorded allocation traces
+
+#include "memory_manager.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#ifndef _MSC_VER
+#include <malloc.h>
+#endif
+
+namespace BenchmarkConstants
+{
+	// each power of two of nanoseconds is split into 1 << HISTOGRAM_SUB_BITS buckets
+	constexpr int HISTOGRAM_SUB_BITS = 3;
+	constexpr int HISTOGRAM_BUCKETS = 64 << HISTOGRAM_SUB_BITS;
+	// RSS and live bytes are sampled every SAMPLE_INTERVAL operations per thread
+	constexpr int SAMPLE_INTERVAL = 4096;
+	// handed-over objects are freed every INBOX_INTERVAL operations
+	constexpr int INBOX_INTERVAL = 64;
+}
+
+// the C library's allocator behind the MemoryManager interface, as a baseline
+class BasicMemoryManager : public MemoryManager
+{
+	void* allocate(size_t size) override final { return std::malloc(size); }
+	void free(void* ptr) override final { std::free(ptr); }
+	void* reallocate(void* ptr, size_t size) override final { return std::realloc(ptr, size); }
+#ifdef _MSC_VER
+	size_t usableSize(void* ptr) override final { return _msize(ptr); }
+#else
+	size_t usableSize(void* ptr) override final { return malloc_usable_size(ptr); }
+#endif
+	size_t reportFreeSpace() override final { return 0; }
+	size_t reportTotalSpace() override final { return 0; }
+};
+
+// piecewise log-uniform size distribution
+class SizeDistribution
+{
+public:
+	struct Range
+	{
+		size_t from;
+		size_t to;
+		double weight;
+	};
+private:
+	std::vector<Range> ranges;
+	std::discrete_distribution<int> pick;
+public:
+	SizeDistribution(const std::vector<Range>& ranges);
+	size_t operator()(std::mt19937_64& generator);
+
+	// heavy small-object skew as in server allocation traces, with occasional huge allocations
+	static SizeDistribution realistic();
+	static SizeDistribution uniform(size_t from, size_t to);
+};
+
+// log-linear histogram of nanoseconds, accurate to 1 / (1 << HISTOGRAM_SUB_BITS)
+class LatencyHistogram
+{
+	std::array<uint64_t, BenchmarkConstants::HISTOGRAM_BUCKETS> counts{};
+	uint64_t total = 0;
+	uint64_t maxNs = 0;
+public:
+	void record(uint64_t ns);
+	void merge(const LatencyHistogram& other);
+	// lower bound of the bucket holding the p-th quantile, p in [0, 1]
+	uint64_t percentile(double p) const;
+	uint64_t count() const { return total; }
+	uint64_t max() const { return maxNs; }
+};
+
+struct WorkloadConfig
+{
+	// allocations per run, split over the threads
+	size_t operations = 1 << 20;
+	SizeDistribution sizes = SizeDistribution::realistic();
+	// lifetimes in operations are exponential with one of three means
+	double shortShare = 0.80;
+	double meanShortLifetime = 32;
+	double mediumShare = 0.18;
+	double meanMediumLifetime = 2048;
+	// the rest lives for operations / 8 on average
+	// share of objects freed by the next thread instead of the allocating one
+	double crossThreadShare = 0;
+	// fill every block and check it before it is freed
+	bool verify = false;
+};
+
+struct BenchmarkResult
+{
+	LatencyHistogram allocateLatency;
+	LatencyHistogram freeLatency;
+	uint64_t elapsedMs = 0;
+	size_t peakLiveBytes = 0;
+	// growth of the resident set over the run
+	size_t peakRssBytes = 0;
+	size_t errors = 0;
+};
+
+// manager == nullptr calls malloc and free directly
+BenchmarkResult runWorkload(MemoryManager* manager, const WorkloadConfig& config, int threads, int seed);
+void printResult(const std::string& name, const BenchmarkResult& result);
+
+// a trace resolved for replay: the blocks of the trace are numbered, and each free is matched to the block it frees
+// addresses are reused, so a free takes the oldest live block at its address, in timestamp order
+struct ReplayPlan
+{
+	struct Step
+	{
+		TraceOp op;
+		size_t size;
+		// of ALLOCATE_ALIGNED
+		size_t alignment;
+		// the block the step allocates and the one it frees, -1 for none
+		int64_t block;
+		int64_t source;
+	};
+	std::vector<std::vector<Step>> threads;
+	// by block number
+	std::vector<size_t> blockSizes;
+	// blocks still live when the recording ended, which the replay frees once it is done
+	std::vector<int64_t> unfreed;
+	// frees of blocks allocated before the recording started, which are dropped,
+	// and reallocations of them, which allocate instead
+	size_t unmatched = 0;
+};
+
+ReplayPlan planReplay(const Trace& trace);
+// each thread of the trace on a thread of its own, which waits for a block another thread allocates before freeing it,
+// so that cross-thread frees keep their order; reallocations count as allocations
+// manager == nullptr calls malloc and free directly; managers other than CustomMemoryManager ignore alignments
+BenchmarkResult replayTrace(MemoryManager* manager, const ReplayPlan& plan);
@@ -0,0 +1,31 @@
+#include "hardening.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace HardeningConstants;
+
+void reportHeapCorruption(const char* what, const void* ptr)
+{
+	// no stream, as the heap may be too broken to allocate its buffers
+	std::fprintf(stderr, "heap corruption: %s at %p\n", what, ptr);
+	std::fflush(stderr);
+	std::abort();
+}
+
+int BlockQuarantine::push(void* block, size_t size, Entry* evicted)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	int evictedCount = 0;
+	while (count == QUARANTINE_BLOCKS || (count > 0 && bytes + size > QUARANTINE_BYTES && evictedCount < MAX_EVICTED_BLOCKS))
+	{
+		evicted[evictedCount++] = entries[first];
+		bytes -= entries[first].size;
+		first = (first + 1) % QUARANTINE_BLOCKS;
+		count--;
+	}
+	entries[(first + count) % QUARANTINE_BLOCKS] = Entry{ block, size };
+	count++;
+	bytes += size;
+	return evictedCount;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+// checks of the hardened build, selected at compile time by defining MEMORY_MANAGER_HARDENED
+// blocks of the block pools end in a canary and are poisoned and quarantined when freed;
+// huge blocks carry a tag in front and, with CustomMemoryManagerConfig::useGuardPages, a guard page on each side
+// the checks sit behind HardeningConstants::IS_HARDENED, so that the release build compiles them out
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace HardeningConstants
+{
+#ifdef MEMORY_MANAGER_HARDENED
+	constexpr bool IS_HARDENED = true;
+#else
+	constexpr bool IS_HARDENED = false;
+#endif
+	// word at the end of each block of a block pool, taken out of the block's class
+	constexpr size_t CANARY_SIZE = IS_HARDENED ? sizeof(uint64_t) : 0;
+	// freed blocks of the block pools are filled with it, and checked for it once they leave the quarantine
+	constexpr uint8_t POISON_BYTE = 0xdb;
+	// freed blocks of the block pools wait for up to this many later frees, and this many bytes, before reuse
+	constexpr int QUARANTINE_BLOCKS = IS_HARDENED ? 4096 : 1;
+	constexpr size_t QUARANTINE_BYTES = 4 * (1 << 20);
+	// blocks a single free may push out of the quarantine
+	constexpr int MAX_EVICTED_BLOCKS = 8;
+}
+
+// prints what was found at ptr and aborts; in the hardened build, even with NDEBUG
+[[noreturn]] void reportHeapCorruption(const char* what, const void* ptr);
+
+// FIFO of freed blocks, shared by the threads of a manager
+class BlockQuarantine
+{
+public:
+	struct Entry
+	{
+		void* block;
+		size_t size;
+	};
+private:
+	std::mutex mutex;
+	std::array<Entry, HardeningConstants::QUARANTINE_BLOCKS> entries;
+	int first = 0;
+	int count = 0;
+	size_t bytes = 0;
+public:
+	// queues the block, and moves the oldest blocks over the limits to evicted, up to MAX_EVICTED_BLOCKS
+	// returns the number evicted
+	int push(void* block, size_t size, Entry* evicted);
+};
@@ -0,0 +1,84 @@
+#include "heap_profiler.h"
+
+#include "platform.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace HeapProfilerConstants;
+
+size_t HeapProfiler::bucketOf(void* ptr)
+{
+	// blocks are at least 16 bytes apart
+	return ((size_t)ptr >> 4) * 0x9E3779B97F4A7C15ull >> (64 - Platform::log2Floor(SAMPLE_BUCKETS));
+}
+
+void HeapProfiler::track(Sample* sample)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Sample*& head = buckets[bucketOf(sample->ptr)];
+	sample->next = head;
+	head = sample;
+	liveSamples.fetch_add(1, std::memory_order_relaxed);
+}
+
+HeapProfiler::Sample* HeapProfiler::untrack(void* ptr)
+{
+	if (liveSamples.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (Sample** link = &buckets[bucketOf(ptr)]; *link != nullptr; link = &(*link)->next)
+	{
+		if ((*link)->ptr == ptr)
+		{
+			Sample* ret = *link;
+			*link = ret->next;
+			liveSamples.fetch_sub(1, std::memory_order_relaxed);
+			return ret;
+		}
+	}
+	return nullptr;
+}
+
+void HeapProfiler::writeProfile(std::ostream& out, size_t samplePeriod)
+{
+	// the snapshot is reserved before the lock is taken, as allocating may sample and freeing may untrack
+	std::vector<Sample> samples;
+	samples.reserve(liveSamples.load(std::memory_order_relaxed) + 64);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Sample* head : buckets)
+		{
+			for (Sample* sample = head; sample != nullptr && samples.size() < samples.capacity(); sample = sample->next)
+				samples.push_back(*sample);
+		}
+	}
+	auto isLess = [](const Sample& a, const Sample& b) {
+		return std::lexicographical_compare(a.stack, a.stack + a.depth, b.stack, b.stack + b.depth);
+	};
+	auto isSameStack = [](const Sample& a, const Sample& b) {
+		return std::equal(a.stack, a.stack + a.depth, b.stack, b.stack + b.depth);
+	};
+	std::sort(samples.begin(), samples.end(), isLess);
+
+	// only the live samples are kept, so the allocated figures repeat the in-use ones
+	size_t totalBytes = 0;
+	for (auto& sample : samples)
+		totalBytes += sample.size;
+	out << "heap profile: " << samples.size() << ": " << totalBytes << " [" << samples.size() << ": " << totalBytes
+		<< "] @ heap_v2/" << samplePeriod << "\n";
+	for (size_t from = 0; from < samples.size();)
+	{
+		size_t to = from;
+		size_t bytes = 0;
+		for (; to < samples.size() && isSameStack(samples[from], samples[to]); to++)
+			bytes += samples[to].size;
+		out << (to - from) << ": " << bytes << " [" << (to - from) << ": " << bytes << "] @";
+		for (int i = 0; i < samples[from].depth; i++)
+			out << " 0x" << std::hex << (size_t)samples[from].stack[i] << std::dec;
+		out << "\n";
+		from = to;
+	}
+	out << "\nMAPPED_LIBRARIES:\n" << Platform::mappedLibraries();
+	out.flush();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// sampled allocations of a CustomMemoryManager, kept with their call stacks until freed
+// the manager decides which allocations to sample and provides the storage of the records;
+// writeProfile dumps the live samples as a heap profile in the legacy pprof text format
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+
+namespace HeapProfilerConstants
+{
+	constexpr int MAX_STACK_DEPTH = 32;
+	// the records are chained per bucket, hashed by address
+	constexpr int SAMPLE_BUCKETS = 4096;
+}
+
+class HeapProfiler
+{
+public:
+	struct Sample
+	{
+		Sample* next;
+		void* ptr;
+		size_t size;
+		int depth;
+		void* stack[HeapProfilerConstants::MAX_STACK_DEPTH];
+	};
+private:
+	std::mutex mutex;
+	std::array<Sample*, HeapProfilerConstants::SAMPLE_BUCKETS> buckets{};
+	// read without the lock, so that frees need not look anything up while nothing is sampled
+	std::atomic<int> liveSamples{ 0 };
+
+	static size_t bucketOf(void* ptr);
+public:
+	// sample is storage for a record, filled but for next
+	void track(Sample* sample);
+	// the record of ptr, for its storage to be freed, or nullptr if ptr was not sampled
+	Sample* untrack(void* ptr);
+	// samplePeriod is the mean number of bytes allocated between two samples, by which pprof scales the samples up
+	// nothing is allocated while the lock is held, so out may be backed by the profiled manager
+	void writeProfile(std::ostream& out, size_t samplePeriod);
+};
@@ -0,0 +1,267 @@
+// drop-in replacement for malloc, free and the global operators new and delete,
+// backed by one process-wide CustomMemoryManager
+// build it as a shared library and preload it into any program:
+//   g++ -std=c++17 -O2 -shared -fPIC -o libmemorymanager.so malloc_shim.cpp hardening.cpp heap_profiler.cpp memory_manager.cpp memory_pool.cpp per_cpu_cache.cpp platform.cpp stats.cpp thread_cache.cpp trace_recorder.cpp -lpthread
+//   LD_PRELOAD=./libmemorymanager.so program
+// with MEMORY_MANAGER_TRACE=path set, the program's allocations are recorded there for the replay tool in replay.cpp
+// with MEMORY_MANAGER_PER_CPU_CACHES set, the threads share per-CPU caches instead of keeping a cache each
+// the manager is created on the first allocation, whenever that happens during startup, and never destroyed,
+// so that blocks freed by static destructors and exiting threads still have a home
+
+#if !defined(_WIN32)
+
+#include "memory_manager.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+
+namespace MallocShimConstants
+{
+	// serves the allocations made while the manager itself is being constructed
+	constexpr size_t BOOTSTRAP_ARENA_SIZE = 1 << 20;
+	// alignment of a fundamental type, guaranteed by malloc
+	constexpr size_t MAX_ALIGN = alignof(std::max_align_t);
+	// bootstrap blocks keep their size in front
+	constexpr size_t BOOTSTRAP_HEADER_SIZE = MAX_ALIGN;
+}
+
+using namespace MallocShimConstants;
+
+namespace
+{
+	enum State
+	{
+		UNINITIALIZED, INITIALIZING, READY,
+	};
+	// constant-initialized, so usable before any static constructor has run
+	std::atomic<int> state{ UNINITIALIZED };
+	CustomMemoryManager* manager = nullptr;
+	alignas(CustomMemoryManager) unsigned char managerStorage[sizeof(CustomMemoryManager)];
+
+	// bump allocator; its blocks are never reused
+	alignas(MAX_ALIGN) unsigned char bootstrapArena[BOOTSTRAP_ARENA_SIZE];
+	std::atomic<size_t> bootstrapUsed{ 0 };
+
+	void* bootstrapAllocate(size_t size, size_t alignment)
+	{
+		alignment = std::max(alignment, MAX_ALIGN);
+		size_t used = bootstrapUsed.load(std::memory_order_relaxed);
+		size_t address, end;
+		do {
+			address = ((size_t)bootstrapArena + used + BOOTSTRAP_HEADER_SIZE + alignment - 1) / alignment * alignment;
+			end = address + size;
+			if (end > (size_t)bootstrapArena + BOOTSTRAP_ARENA_SIZE)
+				return nullptr;
+		} while (!bootstrapUsed.compare_exchange_weak(used, end - (size_t)bootstrapArena, std::memory_order_relaxed));
+		((size_t*)address)[-1] = size;
+		return (void*)address;
+	}
+
+	bool isBootstrap(void* ptr)
+	{
+		return ptr >= bootstrapArena && ptr < bootstrapArena + BOOTSTRAP_ARENA_SIZE;
+	}
+
+	// nullptr while the manager is being constructed, by this or another thread
+	CustomMemoryManager* getManager()
+	{
+		if (state.load(std::memory_order_acquire) == READY)
+			return manager;
+		int expected = UNINITIALIZED;
+		if (state.compare_exchange_strong(expected, INITIALIZING, std::memory_order_acquire))
+		{
+			CustomMemoryManagerConfig config;
+			config.tracePath = std::getenv("MEMORY_MANAGER_TRACE");
+			config.usePerCpuCaches = std::getenv("MEMORY_MANAGER_PER_CPU_CACHES") != nullptr;
+			manager = new (managerStorage) CustomMemoryManager(config);
+			state.store(READY, std::memory_order_release);
+			return manager;
+		}
+		return expected == READY ? manager : nullptr;
+	}
+
+	void* allocate(size_t size, size_t alignment)
+	{
+		CustomMemoryManager* m = getManager();
+		if (m == nullptr)
+			return bootstrapAllocate(size, alignment);
+		// every block is aligned by 8
+		if (alignment > sizeof(void*))
+			return m->allocateAligned(size, alignment);
+		return m->allocate(size);
+	}
+
+	// the size classes are multiples of 8 only, so MAX_ALIGN is kept for the sizes that are multiples of it,
+	// as only objects of those sizes can need it
+	size_t defaultAlignment(size_t size)
+	{
+		return size % MAX_ALIGN == 0 ? MAX_ALIGN : sizeof(void*);
+	}
+
+	void release(void* ptr)
+	{
+		if (ptr == nullptr || isBootstrap(ptr))
+			return;
+		// blocks are only ever handed out once the manager exists
+		manager->free(ptr);
+	}
+
+	size_t usableSize(void* ptr)
+	{
+		if (ptr == nullptr)
+			return 0;
+		if (isBootstrap(ptr))
+			return ((size_t*)ptr)[-1];
+		return manager->usableSize(ptr);
+	}
+
+	bool isPowerOfTwo(size_t value)
+	{
+		return value != 0 && (value & (value - 1)) == 0;
+	}
+
+	void* allocateOrThrow(size_t size, size_t alignment)
+	{
+		void* ptr = allocate(size, alignment);
+		if (ptr == nullptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+}
+
+extern "C"
+{
+	void* malloc(size_t size) noexcept
+	{
+		void* ptr = allocate(size, defaultAlignment(size));
+		if (ptr == nullptr)
+			errno = ENOMEM;
+		return ptr;
+	}
+
+	void free(void* ptr) noexcept
+	{
+		release(ptr);
+	}
+
+	void* calloc(size_t count, size_t size) noexcept
+	{
+		size_t total;
+		if (__builtin_mul_overflow(count, size, &total))
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		void* ptr = allocate(total, defaultAlignment(total));
+		if (ptr == nullptr)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		std::memset(ptr, 0, total);
+		return ptr;
+	}
+
+	void* realloc(void* ptr, size_t size) noexcept
+	{
+		if (ptr == nullptr)
+			return malloc(size);
+		if (size == 0)
+		{
+			release(ptr);
+			return nullptr;
+		}
+		if (!isBootstrap(ptr))
+		{
+			ptr = manager->reallocate(ptr, size);
+			if ((size_t)ptr % defaultAlignment(size) == 0)
+				return ptr;
+		}
+		// bootstrap blocks, and blocks that moved to a class not aligned by MAX_ALIGN
+		void* newPtr = allocate(size, defaultAlignment(size));
+		if (newPtr == nullptr)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		std::memcpy(newPtr, ptr, std::min(usableSize(ptr), size));
+		release(ptr);
+		return newPtr;
+	}
+
+	int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept
+	{
+		if (!isPowerOfTwo(alignment) || alignment % sizeof(void*) != 0)
+			return EINVAL;
+		void* ptr = allocate(size, alignment);
+		if (ptr == nullptr)
+			return ENOMEM;
+		*memptr = ptr;
+		return 0;
+	}
+
+	void* aligned_alloc(size_t alignment, size_t size) noexcept
+	{
+		if (!isPowerOfTwo(alignment))
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+		void* ptr = allocate(size, alignment);
+		if (ptr == nullptr)
+			errno = ENOMEM;
+		return ptr;
+	}
+
+	void* memalign(size_t alignment, size_t size) noexcept
+	{
+		return aligned_alloc(alignment, size);
+	}
+
+	void* valloc(size_t size) noexcept
+	{
+		return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+	}
+
+	void* pvalloc(size_t size) noexcept
+	{
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		return aligned_alloc(pageSize, (size + pageSize - 1) / pageSize * pageSize);
+	}
+
+	size_t malloc_usable_size(void* ptr) noexcept
+	{
+		return usableSize(ptr);
+	}
+}
+
+void* operator new(size_t size) { return allocateOrThrow(size, defaultAlignment(size)); }
+void* operator new[](size_t size) { return allocateOrThrow(size, defaultAlignment(size)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate(size, defaultAlignment(size)); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate(size, defaultAlignment(size)); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocateOrThrow(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocateOrThrow(size, (size_t)alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, (size_t)alignment); }
+
+void operator delete(void* ptr) noexcept { release(ptr); }
+void operator delete[](void* ptr) noexcept { release(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { release(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { release(ptr); }
+// sized deletes cannot pass the size on: new takes a larger class for sizes that are multiples of MAX_ALIGN
+void operator delete(void* ptr, size_t) noexcept { release(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { release(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { release(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { release(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { release(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { release(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { release(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { release(ptr); }
+
+#endif
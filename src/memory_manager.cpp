@@ -2,55 +2,211 @@
 
 #include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
 
 size_t CustomMemoryManagerConstants::getPageNum(size_t ptr) { return ptr >> 21; }
 size_t CustomMemoryManagerConstants::getPageNum(void* ptr) { return (size_t)ptr >> 21; }
-int CustomMemoryManagerConstants::getPageHash(size_t ptr) { return (ptr >> 21) & (TOTAL_PAGE_NUM-1); }
-int CustomMemoryManagerConstants::getPageHash(void* ptr) { return ((size_t)ptr >> 21) & (TOTAL_PAGE_NUM-1); }
 int CustomMemoryManagerConstants::getSmallPageNum(size_t ptr) { return (ptr & ((1 << 21) - 1)) >> 12; }
 int CustomMemoryManagerConstants::getSmallPageNum(void* ptr) { return ((size_t)ptr & ((1 << 21) - 1)) >> 12; }
 
 using namespace CustomMemoryManagerConstants;
+using HardeningConstants::IS_HARDENED;
+using HardeningConstants::CANARY_SIZE;
 
-CustomMemoryManager::CustomMemoryManager():
+namespace
+{
+	std::atomic<int> nextThreadArena{ 0 };
+	thread_local int threadArena = -1;
+
+	// the thread's NUMA node, shared by the managers, and the uses left until it is looked up again
+	struct NodeState
+	{
+		int node;
+		int usesLeft;
+	};
+	thread_local NodeState nodeState;
+
+	// heap profiler sampling of the thread, shared by the managers; trivially destructible, as the thread caches are
+	struct SamplingState
+	{
+		// the allocation that takes it below zero is sampled
+		int64_t bytesUntilSample;
+		// xorshift state, 0 until the thread's first allocation
+		uint64_t random;
+		// set while a sample is being taken, whose own allocations are not sampled
+		bool isSampling;
+	};
+	thread_local SamplingState samplingState;
+
+	// set while an operation of the thread is traced, so that the operations it is made of are not
+	thread_local bool isTracing;
+
+	// exponential, so that sampling is a Poisson process over the allocated bytes
+	int64_t nextSampleInterval(uint64_t& random, size_t mean)
+	{
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		double unit = ((random >> 11) + 1) * (1.0 / ((uint64_t)1 << 53));
+		return (int64_t)(-std::log(unit) * mean) + 1;
+	}
+
+	// in front of each huge block of the hardened build
+	struct HugeBlockTag
+	{
+		// bytes from the block to its end, or to the trailing guard page
+		size_t size;
+		// of the block's address and the secret, cleared when the block is freed
+		uint64_t check;
+	};
+
+	constexpr size_t multipleGeq(size_t size, size_t multiple)
+	{
+		return (size + multiple - 1) / multiple * multiple;
+	}
+
+	// the tag sits right before the block, or before its leading guard page, which the block's first page follows
+	HugeBlockTag* tagOf(void* ptr, bool hasGuards)
+	{
+		if (!hasGuards)
+			return (HugeBlockTag*)((size_t)ptr - sizeof(HugeBlockTag));
+		const size_t firstPage = (size_t)ptr / Platform::SYSTEM_PAGE_SIZE * Platform::SYSTEM_PAGE_SIZE;
+		return (HugeBlockTag*)(firstPage - Platform::SYSTEM_PAGE_SIZE - sizeof(HugeBlockTag));
+	}
+}
+
+CustomMemoryManager::CustomMemoryManager(const CustomMemoryManagerConfig& config):
+	config(config),
+	canarySecret(((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint64_t)this) * 0x9E3779B97F4A7C15ull),
+	perCpuCache(this, config.usePerCpuCaches),
+	traceRecorder(config.tracePath),
+	numaNodes(std::max(1, std::min(Platform::numaNodeCount(), MAX_NUMA_NODES))),
+	arenasPerNode(std::max(1, std::min((int)std::thread::hardware_concurrency(), MAX_HUGE_ARENAS) / numaNodes)),
+	hugeArenaCount(numaNodes * arenasPerNode),
 	internalPool(MemoryListPool(this, INTERNAL_POOL_SIZE))
 {
+	for (int i = 0; i < hugeArenaCount; i++)
+		hugeArenas[i].node = i / arenasPerNode;
 	const size_t from = (size_t)internalPool.baseAddress;
 	const size_t to = from + INTERNAL_POOL_SIZE - PAGE_SIZE;
+	pageMap.reserve(getPageNum(from), getPageNum(to),
+		[this]() { return internalPool.allocate(sizeof(PageMap::Leaf)); },
+		[this](void* ptr) { internalPool.free(ptr); });
 	for (size_t pageAddress = from; pageAddress <= to; pageAddress += PAGE_SIZE)
 	{
-		int pageHash = getPageHash(pageAddress);
 		size_t pageNum = getPageNum(pageAddress);
 		void* address = internalPool.allocate(sizeof(Page));
 		Page* page = new (address) Page(Page::PageType::INTERNAL, &internalPool, pageNum);
-		pages[pageHash].push_back(page);
+		pageMap.set(pageNum, page);
 	}
 
 	//std::cout << getPageNum((size_t)internalPool.baseAddress) << std::endl;
 	//std::cout << getPageNum(to) << std::endl;
+
+	if (config.backgroundPurge && config.purgeDecayMs >= 0)
+		purgeThread = std::thread(&CustomMemoryManager::purgeLoop, this);
 }
 
 CustomMemoryManager::~CustomMemoryManager()
 {
+	if (purgeThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(purgeMutex);
+			isStopping = true;
+		}
+		purgeCondition.notify_one();
+		purgeThread.join();
+	}
+	// the cache's storage lives in the internal pool and goes with it, but its trace events are written first
+	for (ThreadCache* cache = threadCaches; cache != nullptr; cache = cache->nextOfManager)
+	{
+		if (cache->traceBuffer != nullptr)
+			traceRecorder.flush(*cache->traceBuffer);
+	}
+	ThreadCache::discard(this);
+	// pages, block pools and pool objects live in the internal pool; only the huge pools' pages are unmapped here
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		for (MemoryListPool* pool = hugeArenas[i].pools; pool != nullptr;)
+		{
+			MemoryListPool* next = pool->next;
+			pool->~MemoryListPool();
+			pool = next;
+		}
+	}
+}
+
+int CustomMemoryManager::currentArenaIndex()
+{
+	if (threadArena < 0)
+		threadArena = nextThreadArena.fetch_add(1, std::memory_order_relaxed) & (MAX_HUGE_ARENAS - 1);
+	// one of the arenas of the thread's node
+	return currentNode() * arenasPerNode + threadArena % arenasPerNode;
+}
 
+int CustomMemoryManager::currentNode()
+{
+	if (numaNodes == 1)
+		return 0;
+	NodeState& state = nodeState;
+	if (--state.usesLeft < 0)
+	{
+		state.node = Platform::currentNumaNode();
+		state.usesLeft = NUMA_NODE_REFRESH_INTERVAL;
+	}
+	return state.node % numaNodes;
+}
+
+void CustomMemoryManager::countCrossNodeFree(Page* page, int count)
+{
+	// the internal pool is placed nowhere in particular
+	if (page == nullptr || page->hugePool->node < 0 || page->hugePool->node == currentNode())
+		return;
+	// counted by the calling thread's cache, as the frees themselves are
+	if (perCpuCache.isActive())
+	{
+		perCpuCache.countCrossNodeFrees(count);
+		return;
+	}
+	ThreadCache* cache = ThreadCache::get(this);
+	if (cache != nullptr)
+		SizeClassCounters::add(cache->crossNodeFrees, count);
+	else
+		crossNodeFrees.fetch_add(count, std::memory_order_relaxed);
 }
 
-void CustomMemoryManager::grow()
+void CustomMemoryManager::grow(HugeArena& arena, int arenaIndex)
 {
-	void* ptr = internalPool.allocate(sizeof(MemoryListPool));
-	MemoryListPool* hugePool = new (ptr) MemoryListPool(this, nextHugePoolSize);
-	hugePools.push_back(hugePool);
+	void* ptr = allocateFromInternalPool(sizeof(MemoryListPool));
+	// huge pages would be split by the guard pages
+	const bool useHugePages = config.useHugePages && !(IS_HARDENED && config.useGuardPages);
+	// placed on the arena's node only where there is more than one
+	MemoryListPool* hugePool = new (ptr) MemoryListPool(this, arena.nextPoolSize, useHugePages, numaNodes > 1 ? arena.node : -1);
+	hugePool->arena = arenaIndex;
+	// appended, so that older pools are tried first
+	if (arena.lastPool != nullptr)
+		arena.lastPool->next = hugePool;
+	else
+		arena.pools = hugePool;
+	arena.lastPool = hugePool;
 	const size_t from = (size_t)hugePool->baseAddress;
-	const size_t to = from + nextHugePoolSize - PAGE_SIZE;
+	const size_t to = from + arena.nextPoolSize - PAGE_SIZE;
+	pageMap.reserve(getPageNum(from), getPageNum(to),
+		[this]() { return allocateFromInternalPool(sizeof(PageMap::Leaf)); },
+		[this](void* ptr) { freeFromInternalPool(ptr); });
 	for (size_t pageAddress = from; pageAddress <= to; pageAddress += PAGE_SIZE)
 	{
-		int pageHash = getPageHash(pageAddress);
 		size_t pageNum = getPageNum(pageAddress);
-		void* address = internalPool.allocate(sizeof(Page));
-		Page* page = new (address) Page(Page::PageType::HUGE, hugePools.back(), pageNum);
-		pages[pageHash].push_back(page);
+		void* address = allocateFromInternalPool(sizeof(Page));
+		Page* page = new (address) Page(Page::PageType::HUGE, hugePool, pageNum);
+		pageMap.set(pageNum, page);
 	}
-	nextHugePoolSize <<= 1;
+	arena.nextPoolSize <<= 1;
 
 	// std::cout << getPageNum(address) << std::endl;
 	// std::cout << getPageNum(to) << std::endl;
@@ -58,27 +214,130 @@ void CustomMemoryManager::grow()
 
 void* CustomMemoryManager::allocate(size_t size)
 {
+	if (traceRecorder.isRecording() && !isTracing)
+	{
+		isTracing = true;
+		void* ptr = allocate(size);
+		isTracing = false;
+		trace(TraceOp::ALLOCATE, ptr, 0, size);
+		return ptr;
+	}
+	// all an unsampled allocation pays for the profiler is the countdown
+	if (config.profileSampleBytes != 0 && (samplingState.bytesUntilSample -= (int64_t)size) < 0)
+	{
+		void* ptr = allocateSampled(size, Platform::MEMORY_ALLOCATION_ALIGNMENT);
+		if (ptr != nullptr)
+			return ptr;
+	}
+	return allocateUnsampled(size);
+}
+
+void* CustomMemoryManager::allocateUnsampled(size_t size)
+{
+	// the hardened build keeps the canary after the size bytes
+	const size_t classRequest = size + CANARY_SIZE;
 	// find an available memory pool of the right size
-	if (size <= SMALL_THRESHOLD)
+	if (classRequest <= SMALL_THRESHOLD)
 	{
-		int index = std::lower_bound(SMALL_BLOCK_SIZES.begin(), SMALL_BLOCK_SIZES.end(), size) - SMALL_BLOCK_SIZES.begin();
-		return allocateFromBlockPool(smallMutexes[index], freeSmallPools[index], true, SMALL_BLOCK_SIZES[index]);
+		int index = SmallSizeClasses::index(classRequest);
+		void* ptr = allocateCached(true, index);
+		if (ptr != nullptr)
+			return armBlock(ptr, SMALL_BLOCK_SIZES[index]);
+		return armBlock(allocateFromBlockPool(smallMutexes[index], freeSmallPools[currentNode()][index], true, SMALL_BLOCK_SIZES[index]), SMALL_BLOCK_SIZES[index]);
 	}
-	else if (size <= LARGE_THRESHOLD)
+	else if (classRequest <= LARGE_THRESHOLD)
 	{
-		int index = std::lower_bound(LARGE_BLOCK_SIZES.begin(), LARGE_BLOCK_SIZES.end(), size) - LARGE_BLOCK_SIZES.begin();
-		return allocateFromBlockPool(largeMutexes[index], freeLargePools[index], false, LARGE_BLOCK_SIZES[index]);
+		int index = LargeSizeClasses::index(classRequest);
+		void* ptr = allocateCached(false, index);
+		if (ptr != nullptr)
+			return armBlock(ptr, LARGE_BLOCK_SIZES[index]);
+		return armBlock(allocateFromBlockPool(largeMutexes[index], freeLargePools[currentNode()][index], false, LARGE_BLOCK_SIZES[index]), LARGE_BLOCK_SIZES[index]);
 	}
 	else
 	{
-		return allocateFromListPool(size);
+		return allocateFromListPool(size, Platform::MEMORY_ALLOCATION_ALIGNMENT);
 	}
 }
 
-void* CustomMemoryManager::allocateFromBlockPool(std::shared_mutex& mutex, std::list<MemoryBlockPool*>& pools, bool isSmallPool, int blockSize)
+void* CustomMemoryManager::allocateAligned(size_t size, size_t alignment)
 {
+	assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+	if (traceRecorder.isRecording() && !isTracing)
+	{
+		isTracing = true;
+		void* ptr = allocateAligned(size, alignment);
+		isTracing = false;
+		trace(TraceOp::ALLOCATE_ALIGNED, ptr, alignment, size);
+		return ptr;
+	}
+	if (alignment <= BLOCK_ALIGNMENT)
+		return allocate(size);
+	if (config.profileSampleBytes != 0 && (samplingState.bytesUntilSample -= (int64_t)size) < 0)
 	{
-		std::shared_lock<std::shared_mutex> lock(mutex);
+		void* ptr = allocateSampled(size, std::max(alignment, Platform::MEMORY_ALLOCATION_ALIGNMENT));
+		if (ptr != nullptr)
+			return ptr;
+	}
+	// page alignment and beyond goes to the list pools, which place the block at the alignment without padding
+	const size_t classRequest = size + CANARY_SIZE;
+	if (classRequest > LARGE_THRESHOLD || alignment >= SMALL_POOL_SIZE)
+		return allocateFromListPool(size, alignment);
+
+	// blocks sit at multiples of their size back from the end of their pool, which is 4 KiB aligned,
+	// so a class whose size is a multiple of the alignment hands out aligned blocks
+	// the largest class is a power of two, so the search always ends
+	size_t alignedClass = 0;
+	for (int i = classRequest <= SMALL_THRESHOLD ? SmallSizeClasses::index(classRequest) : SMALL_CLASS_COUNT; i < SMALL_CLASS_COUNT && alignedClass == 0; i++)
+	{
+		if (SMALL_BLOCK_SIZES[i] % alignment == 0)
+			alignedClass = SMALL_BLOCK_SIZES[i];
+	}
+	for (int i = classRequest <= SMALL_THRESHOLD ? 0 : LargeSizeClasses::index(classRequest); i < LARGE_CLASS_COUNT && alignedClass == 0; i++)
+	{
+		if (LARGE_BLOCK_SIZES[i] % alignment == 0)
+			alignedClass = LARGE_BLOCK_SIZES[i];
+	}
+	// or a class with room to round the block up to the alignment, when that wastes less
+	// free finds the block from any address within it, so even a zero-sized block must not round up to its end
+	const size_t padded = std::max<size_t>(size, 1) + alignment - BLOCK_ALIGNMENT;
+	if (padded + CANARY_SIZE < alignedClass && classSize(padded + CANARY_SIZE) < alignedClass)
+		return (void*)(((size_t)allocateUnsampled(padded) + alignment - 1) & ~(alignment - 1));
+	return allocateUnsampled(alignedClass - CANARY_SIZE);
+}
+
+void* CustomMemoryManager::allocateSampled(size_t size, size_t alignment)
+{
+	SamplingState& state = samplingState;
+	if (state.isSampling)
+		return nullptr;
+	const bool isStarted = state.random != 0;
+	if (!isStarted)
+		state.random = ((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint64_t)&state) | 1;
+	state.bytesUntilSample = nextSampleInterval(state.random, config.profileSampleBytes);
+	// the first countdown of a thread starts at its first allocation, which is not sampled
+	if (!isStarted)
+		return nullptr;
+
+	state.isSampling = true;
+	// taken before any lock, as capturing may allocate
+	void* stack[HeapProfilerConstants::MAX_STACK_DEPTH];
+	int depth = Platform::captureStack(stack, HeapProfilerConstants::MAX_STACK_DEPTH, 1);
+	// from the huge pools, so that only the frees of huge blocks need to check for samples
+	void* ptr = allocateFromListPool(size, alignment);
+	HeapProfiler::Sample* sample = (HeapProfiler::Sample*)allocateFromInternalPool(sizeof(HeapProfiler::Sample));
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->depth = depth;
+	std::copy(stack, stack + depth, sample->stack);
+	heapProfiler.track(sample);
+	state.isSampling = false;
+	return ptr;
+}
+
+void* CustomMemoryManager::allocateFromBlockPool(CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, int blockSize)
+{
+	{
+		std::shared_lock<CountingSharedMutex> lock(mutex);
 		if (!pools.empty())
 		{
 			auto pool = pools.front();
@@ -89,7 +348,7 @@ void* CustomMemoryManager::allocateFromBlockPool(std::shared_mutex& mutex, std::
 	}
 
 	{
-		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::unique_lock<CountingSharedMutex> lock(mutex);
 		while (!pools.empty())
 		{
 			auto pool = pools.front();
@@ -97,11 +356,12 @@ void* CustomMemoryManager::allocateFromBlockPool(std::shared_mutex& mutex, std::
 			if (ptr != nullptr)
 				return ptr;
 			pool->isOnQueue = false;
-			pools.pop_front();
+			pools.popFront();
 		}
 		if (isSmallPool)
 		{
 			auto pool = allocateSmallPage(blockSize, pools);
+			smallPoolCounts[pool->classIndex].fetch_add(1, std::memory_order_relaxed);
 			void* ptr = pool->allocate(0);
 			assert(ptr != nullptr);
 			return ptr;
@@ -116,6 +376,7 @@ void* CustomMemoryManager::allocateFromBlockPool(std::shared_mutex& mutex, std::
 		else
 		{
 			auto pool = allocateLargeBlockPoolPage(blockSize, pools);
+			largePoolCounts[pool->classIndex].fetch_add(1, std::memory_order_relaxed);
 			void* ptr = pool->allocate(0);
 			assert(ptr != nullptr);
 			return ptr;
@@ -123,19 +384,48 @@ void* CustomMemoryManager::allocateFromBlockPool(std::shared_mutex& mutex, std::
 	}
 }
 
-void* CustomMemoryManager::allocateFromListPool(size_t size)
+int CustomMemoryManager::allocateBatchFromBlockPool(CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, int blockSize, void** blocks, int count)
+{
+	int allocated = 0;
+	{
+		std::shared_lock<CountingSharedMutex> lock(mutex);
+		if (!pools.empty())
+		{
+			allocated = pools.front()->allocateBatch(blocks, count);
+		}
+	}
+	// the front pool ran dry; let the slow path rotate the queue or add a page
+	if (allocated == 0)
+		blocks[allocated++] = allocateFromBlockPool(mutex, pools, isSmallPool, blockSize);
+	return allocated;
+}
+
+void* CustomMemoryManager::allocateFromListPool(size_t size, size_t alignment, size_t offset)
+{
+	if constexpr (IS_HARDENED)
+	{
+		assert(offset == 0);
+		return allocateTaggedBlock(size, alignment);
+	}
+	return allocateFromArena(size, alignment, offset);
+}
+
+void* CustomMemoryManager::allocateFromArena(size_t size, size_t alignment, size_t offset)
 {
-	std::unique_lock<std::shared_mutex> lock(hugePoolsMutex);
-	for (auto pool : hugePools)
+	int arenaIndex = currentArenaIndex();
+	HugeArena& arena = hugeArenas[arenaIndex];
+	std::unique_lock<CountingSharedMutex> lock(arena.mutex);
+	arena.hugeAllocations++;
+	for (MemoryListPool* pool = arena.pools; pool != nullptr; pool = pool->next)
 	{
-		void* ptr = pool->allocate(size);
+		void* ptr = pool->allocate(size, alignment, offset);
 		if (ptr != nullptr)
 			return ptr;
 	}
 	while (true)
 	{
-		grow();
-		void* ptr = hugePools.back()->allocate(size);
+		grow(arena, arenaIndex);
+		void* ptr = arena.lastPool->allocate(size, alignment, offset);
 		if (ptr != nullptr)
 			return ptr;
 	}
@@ -143,31 +433,34 @@ void* CustomMemoryManager::allocateFromListPool(size_t size)
 
 void* CustomMemoryManager::allocateFromInternalPool(size_t size)
 {
-	std::unique_lock<std::shared_mutex> lock(internalPoolMutex);
+	std::unique_lock<CountingSharedMutex> lock(internalPoolMutex);
 	void* ptr = internalPool.allocate(size);
 	assert(ptr != nullptr);
 	return ptr;
 }
 
-MemoryBlockPool* CustomMemoryManager::allocateLargeBlockPoolPage(int blockSize, std::list<MemoryBlockPool*>& pools)
+MemoryBlockPool* CustomMemoryManager::allocateLargeBlockPoolPage(int blockSize, BlockPoolQueue& pools)
 {
 	return allocatePage(false, blockSize, pools);
 }
 
 MemoryBlockPool* CustomMemoryManager::allocateSmallBlockPoolPage()
 {
-	return allocatePage(true, SMALL_POOL_SIZE, freeSmallBlockPoolPages);
+	return allocatePage(true, SMALL_POOL_SIZE, freeSmallBlockPoolPages[currentNode()]);
 }
 
-MemoryBlockPool* CustomMemoryManager::allocatePage(bool forSmallPages, int blockSize, std::list<MemoryBlockPool*>& pools)
+MemoryBlockPool* CustomMemoryManager::allocatePage(bool forSmallPages, int blockSize, BlockPoolQueue& pools)
 {
-	std::unique_lock<std::shared_mutex> lock(hugePoolsMutex);
+	int arenaIndex = currentArenaIndex();
+	HugeArena& arena = hugeArenas[arenaIndex];
+	std::unique_lock<CountingSharedMutex> lock(arena.mutex);
 
 	void* dataAddress = nullptr;
 	MemoryListPool* hugePool = nullptr;
-	for (auto pool : hugePools)
+	MemoryListPool::BoundaryTag tag;
+	for (MemoryListPool* pool = arena.pools; pool != nullptr; pool = pool->next)
 	{
-		dataAddress = pool->allocateAligned(LARGE_POOL_SIZE);
+		dataAddress = pool->allocatePage(tag);
 		if (dataAddress != nullptr) {
 			hugePool = pool;
 			break;
@@ -176,13 +469,14 @@ MemoryBlockPool* CustomMemoryManager::allocatePage(bool forSmallPages, int block
 
 	if (dataAddress == nullptr)
 	{
-		grow();
-		hugePool = hugePools.back();
-		dataAddress = hugePool->allocateAligned(LARGE_POOL_SIZE);
+		grow(arena, arenaIndex);
+		hugePool = arena.lastPool;
+		dataAddress = hugePool->allocatePage(tag);
 	}
 
 	assert(dataAddress != nullptr);
-	int pageHash = getPageHash(dataAddress);
+	if (hugePool->backing == Platform::PageBacking::HUGETLB)
+		hugetlbBlockPoolPages++;
 	size_t pageNum = getPageNum(dataAddress);
 
 	Page* newPage;
@@ -200,142 +494,644 @@ MemoryBlockPool* CustomMemoryManager::allocatePage(bool forSmallPages, int block
 		dataPool = &((LargeBlockPoolPage*)newPage)->dataPool;
 	}
 
-	for (auto& page : pages[pageHash])
+	// from here on the huge pool finds the page's tag out of band
+	newPage->poolTag = tag;
+	Page* page = pageMap.get(pageNum);
+	assert(page != nullptr && page->t == Page::PageType::HUGE);
+	pageMap.set(pageNum, newPage);
+	// delete page;
+	freeFromInternalPool(page);
+	return dataPool;
+}
+
+MemoryBlockPool* CustomMemoryManager::allocateSmallPage(int blockSize, BlockPoolQueue& pools)
+{
+	void* dataAddress = allocateFromBlockPool(smallPagePoolMutex, freeSmallBlockPoolPages[currentNode()], false, SMALL_POOL_SIZE);
+	int smallPageNum = getSmallPageNum(dataAddress);
+	SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)pageMap.get(dataAddress);
+	assert(sPage != nullptr && sPage->t == Page::PageType::SMALL);
+	void* poolAddress = allocateFromInternalPool(sizeof(MemoryBlockPool));
+	auto pool = new (poolAddress) MemoryBlockPool(this, dataAddress, SMALL_POOL_SIZE, blockSize, pools, config.useBitmapPools && blockSize <= MAX_BITMAP_BLOCK_SIZE);
+	assert(sPage->smallPools[smallPageNum] == nullptr);
+	sPage->smallPools[smallPageNum] = pool;
+	return pool;
+}
+
+void CustomMemoryManager::free(void* ptr)
+{
+	if (traceRecorder.isRecording() && !isTracing && ptr != nullptr)
+	{
+		trace(TraceOp::FREE, ptr, 0, 0);
+		isTracing = true;
+		free(ptr);
+		isTracing = false;
+		return;
+	}
+	if constexpr (IS_HARDENED)
+	{
+		// the block waits in the quarantine, and the blocks it pushes out are freed in its place
+		void* evicted[HardeningConstants::MAX_EVICTED_BLOCKS];
+		int count = quarantineBlock(ptr, evicted);
+		for (int i = 0; i < count; i++)
+			freeNow(evicted[i]);
+		return;
+	}
+	freeNow(ptr);
+}
+
+void CustomMemoryManager::freeNow(void* ptr)
+{
+	Page* page = findPage(ptr);
+	if (page == nullptr)
+		return;
+	if (numaNodes > 1)
+		countCrossNodeFree(page);
+	switch (page->t)
+	{
+	case Page::PageType::INTERNAL:
+	{
+		// not supposed to come here
+		assert(false);
+		freeFromInternalPool(ptr);
+		return;
+	}
+	case Page::PageType::HUGE:
+	{
+		auto pool = page->hugePool;
+		freeFromListPool(ptr, pool);
+		return;
+	}
+	case Page::PageType::LARGE:
+	{
+		LargeBlockPoolPage* lPage = (LargeBlockPoolPage*)page;
+		auto pool = &(lPage->dataPool);
+		int index = pool->classIndex;
+		// blocks from allocateAligned may have been rounded up within their block
+		ptr = pool->blockStart(ptr);
+		if (freeCached(ptr, false, index))
+			return;
+		freeFromBlockPool(ptr, pool, largeMutexes[index], *pool->freePools, false);
+		return;
+	}
+	case Page::PageType::SMALL:
+	{
+		SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)page;
+		int smallPageNum = getSmallPageNum(ptr);
+		auto pool = sPage->smallPools[smallPageNum];
+		int index = pool->classIndex;
+		ptr = pool->blockStart(ptr);
+		if (freeCached(ptr, true, index))
+			return;
+		freeFromBlockPool(ptr, pool, smallMutexes[index], *pool->freePools, true);
+		return;
+	}
+	}
+}
+
+void* CustomMemoryManager::reallocate(void* ptr, size_t size)
+{
+	if (traceRecorder.isRecording() && !isTracing)
+	{
+		isTracing = true;
+		void* newPtr = reallocate(ptr, size);
+		isTracing = false;
+		trace(TraceOp::REALLOCATE, newPtr, (uint64_t)ptr, size);
+		return newPtr;
+	}
+	if (ptr == nullptr)
+		return allocate(size);
+	if (size == 0)
+	{
+		free(ptr);
+		return nullptr;
+	}
+	Page* page = findPage(ptr);
+	assert(page != nullptr);
+	if (page->t == Page::PageType::HUGE)
+		return reallocateFromListPool(ptr, size, page->hugePool);
+
+	// the block stays while the size keeps its class, so that a sized free still finds the class
+	MemoryBlockPool* pool = findBlockPool(ptr);
+	const size_t usable = pool->usableSize(ptr) - CANARY_SIZE;
+	if (size <= usable && classSize(size + CANARY_SIZE) == (size_t)pool->blockSize)
+		return ptr;
+	void* newPtr = allocate(size);
+	std::memcpy(newPtr, ptr, std::min(size, usable));
+	free(ptr);
+	return newPtr;
+}
+
+void* CustomMemoryManager::reallocateFromListPool(void* ptr, size_t size, MemoryListPool* pool)
+{
+	if constexpr (IS_HARDENED)
+	{
+		// tagged blocks are neither resized in place nor remapped
+		void* newPtr = allocate(size);
+		std::memcpy(newPtr, ptr, std::min(size, taggedBlockSize(ptr)));
+		freeFromListPool(ptr, pool);
+		return newPtr;
+	}
+	size_t oldSize;
+	{
+		// the header is read under the lock, as a free of the block before or after rewrites its flags
+		std::unique_lock<CountingSharedMutex> lock(hugeArenas[pool->arena].mutex);
+		// a block that shrinks into the classes moves there, so that its tier and size classes agree
+		if (size > LARGE_THRESHOLD && pool->resize(ptr, size))
+			return ptr;
+		oldSize = pool->usableSize(ptr);
+	}
+	void* newPtr;
+	if (size > LARGE_THRESHOLD && oldSize >= MIN_REMAP_SIZE && pool->backing != Platform::PageBacking::HUGETLB)
+	{
+		// at the same offset within a system page, so that the whole pages can be remapped rather than copied
+		newPtr = allocateFromListPool(size, Platform::SYSTEM_PAGE_SIZE, (size_t)ptr % Platform::SYSTEM_PAGE_SIZE);
+		if (findPage(newPtr)->hugePool->backing != Platform::PageBacking::HUGETLB)
+			Platform::movePages(ptr, newPtr, oldSize);
+		else
+			std::memcpy(newPtr, ptr, oldSize);
+	}
+	else
+	{
+		newPtr = allocate(size);
+		std::memcpy(newPtr, ptr, std::min(size, oldSize));
+	}
+	freeFromListPool(ptr, pool);
+	return newPtr;
+}
+
+size_t CustomMemoryManager::usableSize(void* ptr)
+{
+	Page* page = findPage(ptr);
+	assert(page != nullptr);
+	switch (page->t)
+	{
+	case Page::PageType::HUGE:
+	{
+		if constexpr (IS_HARDENED)
+			return taggedBlockSize(ptr);
+		std::shared_lock<CountingSharedMutex> lock(hugeArenas[page->hugePool->arena].mutex);
+		return page->hugePool->usableSize(ptr);
+	}
+	case Page::PageType::LARGE:
+		return ((LargeBlockPoolPage*)page)->dataPool.usableSize(ptr) - CANARY_SIZE;
+	case Page::PageType::SMALL:
+		return ((SmallBlockPoolPage*)page)->smallPools[getSmallPageNum(ptr)]->usableSize(ptr) - CANARY_SIZE;
+	default:
+		// not supposed to come here
+		assert(false);
+		return 0;
+	}
+}
+
+void CustomMemoryManager::free(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return;
+	if (traceRecorder.isRecording() && !isTracing)
+	{
+		trace(TraceOp::FREE_SIZED, ptr, 0, size);
+		isTracing = true;
+		free(ptr, size);
+		isTracing = false;
+		return;
+	}
+	// a sampled block is not of the class of its size, and the hardened build checks every block through free
+	if (IS_HARDENED || config.profileSampleBytes != 0)
+	{
+		free(ptr);
+		return;
+	}
+	if (size > LARGE_THRESHOLD)
+	{
+		free(ptr);
+		return;
+	}
+	// the class follows from the size, but only for a block of a pool of that class; any other block,
+	// e.g. from allocateAligned or handed a wrong size, goes through free
+	Page* page = findPage(ptr);
+	MemoryBlockPool* pool = nullptr;
+	if (page != nullptr && page->t == Page::PageType::LARGE)
+		pool = &((LargeBlockPoolPage*)page)->dataPool;
+	else if (page != nullptr && page->t == Page::PageType::SMALL)
+		pool = ((SmallBlockPoolPage*)page)->smallPools[getSmallPageNum(ptr)];
+	if (pool == nullptr || (size_t)pool->blockSize != classSize(size))
+	{
+		free(ptr);
+		return;
+	}
+	if (numaNodes > 1)
+		countCrossNodeFree(page);
+	const bool isSmallPool = size <= SMALL_THRESHOLD;
+	const int index = pool->classIndex;
+	if (freeCached(ptr, isSmallPool, index))
+		return;
+	freeFromBlockPool(ptr, pool, isSmallPool ? smallMutexes[index] : largeMutexes[index], *pool->freePools, isSmallPool);
+}
+
+void CustomMemoryManager::allocateBatch(size_t size, int count, void** blocks)
+{
+	// traced as single allocations
+	if (traceRecorder.isRecording() && !isTracing)
+	{
+		isTracing = true;
+		allocateBatch(size, count, blocks);
+		isTracing = false;
+		for (int i = 0; i < count; i++)
+			trace(TraceOp::ALLOCATE, blocks[i], 0, size);
+		return;
+	}
+	// the hardened build sets up each block as allocate does
+	if constexpr (IS_HARDENED)
+	{
+		MemoryManager::allocateBatch(size, count, blocks);
+		return;
+	}
+	if (size > LARGE_THRESHOLD)
 	{
-		if (page->pageNum == pageNum)
+		for (int i = 0; i < count; i++)
+			blocks[i] = allocateFromListPool(size, Platform::MEMORY_ALLOCATION_ALIGNMENT);
+		return;
+	}
+	const bool isSmallPool = size <= SMALL_THRESHOLD;
+	int index = isSmallPool
+		? SmallSizeClasses::index(size)
+		: LargeSizeClasses::index(size);
+	// straight from the pools, as a batch would only pass through the thread cache
+	countUncached(isSmallPool, index, count, 0);
+	int allocated = 0;
+	while (allocated < count)
+		allocated += allocateBlocks(isSmallPool, index, blocks + allocated, count - allocated);
+}
+
+void CustomMemoryManager::freeBatch(void** blocks, int count)
+{
+	if (traceRecorder.isRecording() && !isTracing)
+	{
+		for (int i = 0; i < count; i++)
 		{
-			// delete page;
-			freeFromInternalPool(page);
-			page = newPage;
-			return dataPool;
+			if (blocks[i] != nullptr)
+				trace(TraceOp::FREE, blocks[i], 0, 0);
 		}
+		isTracing = true;
+		freeBatch(blocks, count);
+		isTracing = false;
+		return;
+	}
+	if constexpr (IS_HARDENED)
+	{
+		MemoryManager::freeBatch(blocks, count);
+		return;
 	}
+	// consecutive blocks of one pool go back together, as the blocks of a batch allocation come in runs per pool
+	int from = 0;
+	while (from < count)
+	{
+		Page* page = findPage(blocks[from]);
+		if (page == nullptr)
+		{
+			from++;
+			continue;
+		}
+		if (page->t == Page::PageType::HUGE)
+		{
+			if (numaNodes > 1)
+				countCrossNodeFree(page);
+			freeFromListPool(blocks[from++], page->hugePool);
+			continue;
+		}
+		const bool isSmallPool = page->t == Page::PageType::SMALL;
+		MemoryBlockPool* pool = findBlockPool(blocks[from]);
+		const size_t begin = (size_t)pool->baseAddress;
+		const size_t end = begin + pool->poolSize;
+		int to = from + 1;
+		while (to < count && (size_t)blocks[to] >= begin && (size_t)blocks[to] < end)
+			to++;
+		const int index = pool->classIndex;
+		if (numaNodes > 1)
+			countCrossNodeFree(page, to - from);
+		countUncached(isSmallPool, index, 0, to - from);
+		if (isSmallPool)
+			freeBatchToBlockPool(blocks + from, to - from, pool, smallMutexes[index], *pool->freePools, true);
+		else
+			freeBatchToBlockPool(blocks + from, to - from, pool, largeMutexes[index], *pool->freePools, false);
+		from = to;
+	}
+}
 
-	// std::cout << pageNum << std::endl;
+Page* CustomMemoryManager::findPage(void* ptr)
+{
+	return pageMap.get(ptr);
+}
 
-	// not reachable
-	assert(false);
-	return nullptr;
+MemoryBlockPool* CustomMemoryManager::findBlockPool(void* ptr)
+{
+	Page* page = findPage(ptr);
+	assert(page != nullptr);
+	if (page->t == Page::PageType::LARGE)
+		return &((LargeBlockPoolPage*)page)->dataPool;
+	assert(page->t == Page::PageType::SMALL);
+	return ((SmallBlockPoolPage*)page)->smallPools[getSmallPageNum(ptr)];
 }
 
-MemoryBlockPool* CustomMemoryManager::allocateSmallPage(int blockSize, std::list<MemoryBlockPool*>& pools)
+uint64_t CustomMemoryManager::canaryOf(void* block) const
 {
-	void* dataAddress = allocateFromBlockPool(smallPagePoolMutex, freeSmallBlockPoolPages, false, SMALL_POOL_SIZE);
-	int pageHash = getPageHash(dataAddress);
-	size_t pageNum = getPageNum(dataAddress);
-	int smallPageNum = getSmallPageNum(dataAddress);
-	for (auto page : pages[pageHash])
+	return ((uint64_t)block * 0x9E3779B97F4A7C15ull) ^ canarySecret;
+}
+
+int CustomMemoryManager::quarantineBlock(void* ptr, void** evicted)
+{
+	if (ptr == nullptr)
+		return 0;
+	Page* page = findPage(ptr);
+	if (page == nullptr || page->t == Page::PageType::INTERNAL)
+		reportHeapCorruption("free of memory not allocated by this manager", ptr);
+	// huge blocks are checked against their tags by freeFromListPool, and go back right away
+	if (page->t == Page::PageType::HUGE)
 	{
-		if (page->pageNum == pageNum)
+		evicted[0] = ptr;
+		return 1;
+	}
+	MemoryBlockPool* pool = page->t == Page::PageType::LARGE
+		? &((LargeBlockPoolPage*)page)->dataPool
+		: ((SmallBlockPoolPage*)page)->smallPools[getSmallPageNum(ptr)];
+	if (pool == nullptr)
+		reportHeapCorruption("free of memory not allocated by this manager", ptr);
+	const size_t blockSize = pool->blockSize;
+	void* block = pool->blockStart(ptr);
+	if ((size_t)ptr < (size_t)block || (size_t)ptr >= (size_t)block + blockSize)
+		reportHeapCorruption("free of an address outside the blocks of its pool", ptr);
+	// inverted while the block is free
+	uint64_t* canary = (uint64_t*)((size_t)block + blockSize - CANARY_SIZE);
+	if (*canary == ~canaryOf(block))
+		reportHeapCorruption("double free", ptr);
+	if (*canary != canaryOf(block))
+		reportHeapCorruption("canary overwritten, by a write past the block or a free of a block never allocated", ptr);
+	std::memset(block, HardeningConstants::POISON_BYTE, blockSize - CANARY_SIZE);
+	*canary = ~canaryOf(block);
+
+	BlockQuarantine::Entry entries[HardeningConstants::MAX_EVICTED_BLOCKS];
+	int count = quarantine.push(block, blockSize, entries);
+	const uint64_t poison = 0x0101010101010101ull * HardeningConstants::POISON_BYTE;
+	for (int i = 0; i < count; i++)
+	{
+		// nothing may have written to the block while it waited, the canary included
+		const uint64_t* words = (const uint64_t*)entries[i].block;
+		const size_t wordCount = (entries[i].size - CANARY_SIZE) / sizeof(uint64_t);
+		for (size_t j = 0; j < wordCount; j++)
 		{
-			SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)page;
-			void* poolAddress = allocateFromInternalPool(sizeof(MemoryBlockPool));
-			auto pool = new (poolAddress) MemoryBlockPool(this, dataAddress, SMALL_POOL_SIZE, blockSize, pools);
-			assert(sPage->smallPools[smallPageNum] == nullptr);
-			sPage->smallPools[smallPageNum] = pool;
-			return pool;
+			if (words[j] != poison)
+				reportHeapCorruption("write after free", (const void*)&words[j]);
 		}
+		if (words[wordCount] != ~canaryOf(entries[i].block))
+			reportHeapCorruption("write after free", (const void*)&words[wordCount]);
+		evicted[i] = entries[i].block;
 	}
-	// not reachable
-	assert(false);
-	return nullptr;
+	return count;
 }
 
-void CustomMemoryManager::free(void* ptr)
+void* CustomMemoryManager::allocateTaggedBlock(size_t size, size_t alignment)
 {
-	int pageHash = getPageHash(ptr);
-	size_t pageNum = getPageNum(ptr);
-	for (auto page : pages[pageHash])
+	// with guard pages, the block ends at the trailing guard, so that even a one-byte overrun faults
+	const bool hasGuards = config.useGuardPages;
+	const size_t pageSize = Platform::SYSTEM_PAGE_SIZE;
+	alignment = std::max(alignment, Platform::MEMORY_ALLOCATION_ALIGNMENT);
+	const size_t unit = hasGuards ? std::max(alignment, pageSize) : alignment;
+	const size_t lead = sizeof(HugeBlockTag) + (hasGuards ? pageSize : 0);
+	const size_t dataSize = multipleGeq(std::max<size_t>(size, 1), hasGuards ? alignment : Platform::MEMORY_ALLOCATION_ALIGNMENT);
+	const size_t dataSpan = hasGuards ? multipleGeq(dataSize, pageSize) : dataSize;
+	// the list pool block starts lead bytes before a multiple of unit
+	const size_t block = (size_t)allocateFromArena(lead + dataSpan + (hasGuards ? pageSize : 0), unit, (unit - lead % unit) % unit);
+	void* ptr = (void*)(block + lead + dataSpan - dataSize);
+	HugeBlockTag* tag = (HugeBlockTag*)block;
+	assert(tag == tagOf(ptr, hasGuards));
+	tag->size = dataSize;
+	tag->check = canaryOf(ptr);
+	if (hasGuards)
+	{
+		Platform::protectPages((void*)(block + sizeof(HugeBlockTag)), pageSize, false);
+		Platform::protectPages((void*)(block + lead + dataSpan), pageSize, false);
+	}
+	return ptr;
+}
+
+void* CustomMemoryManager::untagBlock(void* ptr)
+{
+	const bool hasGuards = config.useGuardPages;
+	HugeBlockTag* tag = tagOf(ptr, hasGuards);
+	// a freed block's tag is cleared, and overwritten by the list pool's links unless the block merged into the one before
+	if (tag->check != canaryOf(ptr))
+		reportHeapCorruption("double free, or free of an address that is no huge block", ptr);
+	tag->check = 0;
+	if (hasGuards)
 	{
-		if (page->pageNum == pageNum)
+		Platform::protectPages((void*)((size_t)tag + sizeof(HugeBlockTag)), Platform::SYSTEM_PAGE_SIZE, true);
+		Platform::protectPages((void*)((size_t)ptr + tag->size), Platform::SYSTEM_PAGE_SIZE, true);
+	}
+	return tag;
+}
+
+size_t CustomMemoryManager::taggedBlockSize(void* ptr)
+{
+	return tagOf(ptr, config.useGuardPages)->size;
+}
+
+void CustomMemoryManager::trace(TraceOp op, void* ptr, uint64_t argument, size_t size)
+{
+	const TraceEvent event = traceRecorder.makeEvent(op, ptr, argument, size);
+	ThreadCache* cache = ThreadCache::get(this);
+	if (cache == nullptr)
+	{
+		traceRecorder.recordUnbuffered(event);
+		return;
+	}
+	if (cache->traceBuffer == nullptr)
+		cache->traceBuffer = new (allocateFromInternalPool(sizeof(TraceBuffer))) TraceBuffer();
+	traceRecorder.record(*cache->traceBuffer, event);
+}
+
+ThreadCache* CustomMemoryManager::allocateThreadCache()
+{
+	void* ptr = allocateFromInternalPool(sizeof(ThreadCache));
+	ThreadCache* cache = new (ptr) ThreadCache(this);
+	std::lock_guard<std::mutex> lock(threadCacheMutex);
+	cache->nextOfManager = threadCaches;
+	if (threadCaches != nullptr)
+		threadCaches->prevOfManager = cache;
+	threadCaches = cache;
+	return cache;
+}
+
+void CustomMemoryManager::freeThreadCache(ThreadCache* cache)
+{
+	{
+		// the counts of the cache outlive it
+		std::lock_guard<std::mutex> lock(threadCacheMutex);
+		for (int i = 0; i < SMALL_CLASS_COUNT + LARGE_CLASS_COUNT; i++)
 		{
-			switch (page->t)
-			{
-			case Page::PageType::INTERNAL:
-			{
-				// not supposed to come here
-				assert(false);
-				freeFromInternalPool(ptr);
-				return;
-			}
-			case Page::PageType::HUGE:
-			{
-				auto pool = page->hugePool;
-				freeFromListPool(ptr, pool);
-				return;
-			}
-			case Page::PageType::LARGE:
-			{
-				LargeBlockPoolPage* lPage = (LargeBlockPoolPage*)page;
-				auto pool = &(lPage->dataPool);
-				int index = std::lower_bound(LARGE_BLOCK_SIZES.begin(), LARGE_BLOCK_SIZES.end(), pool->blockSize) - LARGE_BLOCK_SIZES.begin();
-				freeFromBlockPool(ptr, pool, largeMutexes[index], freeLargePools[index], false);
-				return;
-			}
-			case Page::PageType::SMALL:
-			{
-				SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)page;
-				int smallPageNum = getSmallPageNum(ptr);
-				auto pool = sPage->smallPools[smallPageNum];
-				int index = std::lower_bound(SMALL_BLOCK_SIZES.begin(), SMALL_BLOCK_SIZES.end(), pool->blockSize) - SMALL_BLOCK_SIZES.begin();
-				freeFromBlockPool(ptr, pool, smallMutexes[index], freeSmallPools[index], true);
-				return;
-			}
-			}
+			const bool isSmallPool = i < SMALL_CLASS_COUNT;
+			const int index = isSmallPool ? i : i - SMALL_CLASS_COUNT;
+			const SizeClassCounters& from = cache->counters(isSmallPool, index);
+			SizeClassCounters& to = isSmallPool ? smallCounters[index] : largeCounters[index];
+			to.allocations.fetch_add(from.allocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.frees.fetch_add(from.frees.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.poolAllocations.fetch_add(from.poolAllocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.poolFrees.fetch_add(from.poolFrees.load(std::memory_order_relaxed), std::memory_order_relaxed);
 		}
+		crossNodeFrees.fetch_add(cache->crossNodeFrees.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		(cache->prevOfManager != nullptr ? cache->prevOfManager->nextOfManager : threadCaches) = cache->nextOfManager;
+		if (cache->nextOfManager != nullptr)
+			cache->nextOfManager->prevOfManager = cache->prevOfManager;
+	}
+	if (cache->traceBuffer != nullptr)
+	{
+		traceRecorder.flush(*cache->traceBuffer);
+		freeFromInternalPool(cache->traceBuffer);
 	}
+	cache->~ThreadCache();
+	freeFromInternalPool(cache);
+}
+
+int CustomMemoryManager::allocateBlocks(bool isSmallPool, int index, void** blocks, int count)
+{
+	if (isSmallPool)
+		return allocateBatchFromBlockPool(smallMutexes[index], freeSmallPools[currentNode()][index], true, SMALL_BLOCK_SIZES[index], blocks, count);
+	else
+		return allocateBatchFromBlockPool(largeMutexes[index], freeLargePools[currentNode()][index], false, LARGE_BLOCK_SIZES[index], blocks, count);
+}
+
+void CustomMemoryManager::countUncached(bool isSmallPool, int index, int allocations, int frees)
+{
+	SizeClassCounters& counters = isSmallPool ? smallCounters[index] : largeCounters[index];
+	if (allocations > 0)
+	{
+		counters.allocations.fetch_add(allocations, std::memory_order_relaxed);
+		counters.poolAllocations.fetch_add(allocations, std::memory_order_relaxed);
+	}
+	if (frees > 0)
+	{
+		counters.frees.fetch_add(frees, std::memory_order_relaxed);
+		counters.poolFrees.fetch_add(frees, std::memory_order_relaxed);
+	}
+}
 
+void CustomMemoryManager::freeBlocks(bool isSmallPool, int index, void** blocks, int count)
+{
+	CountingSharedMutex& mutex = isSmallPool ? smallMutexes[index] : largeMutexes[index];
+	// sorting groups the blocks by pool; each group goes back with one CAS
+	std::sort(blocks, blocks + count);
+	int from = 0;
+	while (from < count)
+	{
+		MemoryBlockPool* pool = findBlockPool(blocks[from]);
+		int to = from + 1;
+		while (to < count && findBlockPool(blocks[to]) == pool)
+			to++;
+		freeBatchToBlockPool(blocks + from, to - from, pool, mutex, *pool->freePools, isSmallPool);
+		from = to;
+	}
 }
 
-void CustomMemoryManager::freeFromBlockPool(void* ptr, MemoryBlockPool* pool, std::shared_mutex& mutex, std::list<MemoryBlockPool*>& pools, bool isSmallPool)
+void CustomMemoryManager::freeFromBlockPool(void* ptr, MemoryBlockPool* pool, CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, bool isPagePool)
 {
-	size_t poolSize = isSmallPool ? SMALL_POOL_SIZE : LARGE_POOL_SIZE;
+	const size_t poolSize = pool->poolSize;
+	const int blockSize = pool->blockSize;
 	size_t freeSpace = pool->free(ptr);
+	onBlockPoolFreed(ptr, pool, poolSize, blockSize, freeSpace, mutex, pools, isSmallPool, isPagePool);
+}
+
+void CustomMemoryManager::freeBatchToBlockPool(void** blocks, int count, MemoryBlockPool* pool, CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool)
+{
+	const size_t poolSize = pool->poolSize;
+	const int blockSize = pool->blockSize;
+	void* ptr = blocks[0];
+	size_t freeSpace = pool->freeRemote(blocks, count);
+	onBlockPoolFreed(ptr, pool, poolSize, blockSize, freeSpace, mutex, pools, isSmallPool);
+}
+
+void CustomMemoryManager::onBlockPoolFreed(void* ptr, MemoryBlockPool* pool, size_t poolSize, int blockSize, size_t freeSpace, CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, bool isPagePool)
+{
 	if (freeSpace < poolSize * 3 / 8)
 		return;
 
 	// std::cout << freeSpace << std::endl;
 
+	// once the block is back, another thread may empty and release the pool before we get the lock
 	if (!pool->isOnQueue)
 	{
-		std::unique_lock<std::shared_mutex> lock(mutex);
+		std::unique_lock<CountingSharedMutex> lock(mutex);
+		if (!isLiveBlockPool(ptr, pool, blockSize))
+			return;
 		if (!pool->isOnQueue)
 		{
-			pools.push_back(pool);
-			pool->it = --pools.end();
+			pools.pushBack(pool);
 			pool->isOnQueue = true;
 		}
 	}
 	if (freeSpace == poolSize)
 	{
-		std::unique_lock<std::shared_mutex> lock(mutex);
-		if (pool->isOnQueue && pool->it != pools.begin())
+		std::unique_lock<CountingSharedMutex> lock(mutex);
+		if (!isLiveBlockPool(ptr, pool, blockSize) || pool->currentFreeSpace() != poolSize)
+			return;
+		if (pool->isOnQueue && pools.front() != pool)
 		{
+			// the pool's storage goes away with its page
+			pools.erase(pool);
 			if (isSmallPool)
 			{
+				smallPoolCounts[pool->classIndex].fetch_sub(1, std::memory_order_relaxed);
 				freeSmallPage(pool->baseAddress);
 				// freeSmallPage((void*)pool);
 				freeFromInternalPool(pool);
 			}
 			else
 			{
+				if (!isPagePool)
+					largePoolCounts[pool->classIndex].fetch_sub(1, std::memory_order_relaxed);
 				freePage(pool->baseAddress);
 				// freePage((void*)pool);
 			}
-			pools.erase(pool->it);
 		}
 	}
 }
 
+bool CustomMemoryManager::isLiveBlockPool(void* ptr, MemoryBlockPool* pool, int blockSize)
+{
+	// page descriptors live in the internal pool, so a stale one still reads as mapped memory
+	Page* page = pageMap.get(ptr);
+	if (page == nullptr)
+		return false;
+	if (page->t == Page::PageType::LARGE)
+	{
+		if (&((LargeBlockPoolPage*)page)->dataPool != pool)
+			return false;
+	}
+	else if (page->t == Page::PageType::SMALL)
+	{
+		SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)page;
+		if (&sPage->dataPool != pool && sPage->smallPools[getSmallPageNum(ptr)] != pool)
+			return false;
+	}
+	else
+		return false;
+	return pool->blockSize == blockSize;
+}
+
 void CustomMemoryManager::freeFromListPool(void* ptr, MemoryListPool* pool)
 {
-	std::unique_lock<std::shared_mutex> lock(hugePoolsMutex);
+	HeapProfiler::Sample* sample = heapProfiler.untrack(ptr);
+	if (sample != nullptr)
+		freeFromInternalPool(sample);
+	if constexpr (IS_HARDENED)
+		ptr = untagBlock(ptr);
+	// back to the owning arena, whichever arena the calling thread uses
+	std::unique_lock<CountingSharedMutex> lock(hugeArenas[pool->arena].mutex);
+	hugeArenas[pool->arena].hugeFrees++;
 	pool->free(ptr);
 }
 
 void CustomMemoryManager::freeFromInternalPool(void* ptr)
 {
-	std::unique_lock<std::shared_mutex> lock(internalPoolMutex);
+	std::unique_lock<CountingSharedMutex> lock(internalPoolMutex);
 	internalPool.free(ptr);
 }
 
@@ -343,45 +1139,30 @@ void CustomMemoryManager::freePage(void* ptr)
 {
 	assert(getSmallPageNum(ptr) == 0);
 
-	std::unique_lock<std::shared_mutex> lock(hugePoolsMutex);
-	int pageHash = getPageHash(ptr);
 	size_t pageNum = getPageNum(ptr);
-	for (auto& page : pages[pageHash])
-	{
-		if (page->pageNum == pageNum)
-		{
-			auto hugePool = page->hugePool;
-			hugePool->free(ptr);
-			// delete page;
-			freeFromInternalPool(page);
-			void* ptr = allocateFromInternalPool(sizeof(Page));
-			page = new (ptr) Page(Page::PageType::HUGE, hugePool, pageNum);
-			return;
-		}
-	}
-	// not reachable
-	assert(false);
+	Page* page = pageMap.get(pageNum);
+	assert(page != nullptr);
+	auto hugePool = page->hugePool;
+	std::unique_lock<CountingSharedMutex> lock(hugeArenas[hugePool->arena].mutex);
+	// the page's tag goes back in band once the page map no longer leads to it
+	void* address = allocateFromInternalPool(sizeof(Page));
+	pageMap.set(pageNum, new (address) Page(Page::PageType::HUGE, hugePool, pageNum));
+	hugePool->freePage(ptr, page->poolTag);
+	if (hugePool->backing == Platform::PageBacking::HUGETLB)
+		hugetlbBlockPoolPages--;
+	// delete page;
+	freeFromInternalPool(page);
 }
 
 void CustomMemoryManager::freeSmallPage(void* ptr)
 {
-	int pageHash = getPageHash(ptr);
-	size_t pageNum = getPageNum(ptr);
 	int smallPageNum = getSmallPageNum(ptr);
-	for (auto page : pages[pageHash])
-	{
-		if (page->pageNum == pageNum)
-		{
-			SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)page;
-			assert(sPage->smallPools[smallPageNum] != nullptr);
-			//sPage->smallPools[smallPageNum]->~MemoryBlockPool();
-			sPage->smallPools[smallPageNum] = nullptr;
-			freeFromBlockPool(ptr, &(sPage->dataPool), smallPagePoolMutex, freeSmallBlockPoolPages, false);
-			return;
-		}
-	}
-	// not reachable
-	assert(false);
+	SmallBlockPoolPage* sPage = (SmallBlockPoolPage*)pageMap.get(ptr);
+	assert(sPage != nullptr && sPage->t == Page::PageType::SMALL);
+	assert(sPage->smallPools[smallPageNum] != nullptr);
+	//sPage->smallPools[smallPageNum]->~MemoryBlockPool();
+	sPage->smallPools[smallPageNum] = nullptr;
+	freeFromBlockPool(ptr, &(sPage->dataPool), smallPagePoolMutex, *sPage->dataPool.freePools, false, true);
 }
 
 size_t CustomMemoryManager::reportFreeSpace()
@@ -389,21 +1170,229 @@ size_t CustomMemoryManager::reportFreeSpace()
 	size_t ret = 0;
 
 	//{
-	//	std::unique_lock<std::shared_mutex> lock(internalPoolMutex);
+	//	std::unique_lock<CountingSharedMutex> lock(internalPoolMutex);
 	//	ret += internalPool.freeSpace;
 	//}
 
-	std::unique_lock<std::shared_mutex> lock(hugePoolsMutex);
-	for (auto pool : hugePools)
-		ret += pool->freeSpace;
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		std::unique_lock<CountingSharedMutex> lock(hugeArenas[i].mutex);
+		for (MemoryListPool* pool = hugeArenas[i].pools; pool != nullptr; pool = pool->next)
+			ret += pool->freeSpace;
+	}
 	return ret;
 }
 
 size_t CustomMemoryManager::reportTotalSpace()
 {
 	size_t ret = 0;
-	std::unique_lock<std::shared_mutex> lock(hugePoolsMutex);
-	for (auto pool : hugePools)
-		ret += pool->poolSize;
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		std::unique_lock<CountingSharedMutex> lock(hugeArenas[i].mutex);
+		for (MemoryListPool* pool = hugeArenas[i].pools; pool != nullptr; pool = pool->next)
+			ret += pool->poolSize;
+	}
+	return ret;
+}
+
+HugePageStats CustomMemoryManager::reportHugePages()
+{
+	HugePageStats ret{};
+	std::vector<std::pair<size_t, size_t>> advisedRanges;
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		std::unique_lock<CountingSharedMutex> lock(hugeArenas[i].mutex);
+		for (MemoryListPool* pool = hugeArenas[i].pools; pool != nullptr; pool = pool->next)
+		{
+			if (pool->backing == Platform::PageBacking::HUGETLB)
+				ret.hugetlbPages += pool->poolSize / PAGE_SIZE;
+			else if (pool->backing == Platform::PageBacking::TRANSPARENT_HUGE)
+			{
+				ret.transparentHugeAdvisedPages += pool->poolSize / PAGE_SIZE;
+				advisedRanges.emplace_back((size_t)pool->baseAddress, (size_t)pool->baseAddress + pool->poolSize);
+			}
+		}
+	}
+	ret.hugetlbBlockPoolPages = hugetlbBlockPoolPages;
+	if (!advisedRanges.empty())
+		ret.transparentHugeResidentPages = Platform::transparentHugeBytes(advisedRanges) / PAGE_SIZE;
 	return ret;
-}
\ No newline at end of file
+}
+
+size_t CustomMemoryManager::reportCommittedSpace()
+{
+	size_t ret = 0;
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		std::unique_lock<CountingSharedMutex> lock(hugeArenas[i].mutex);
+		for (MemoryListPool* pool = hugeArenas[i].pools; pool != nullptr; pool = pool->next)
+			ret += pool->poolSize - pool->purgedSpace;
+	}
+	return ret;
+}
+
+MemoryStats CustomMemoryManager::reportStats()
+{
+	MemoryStats ret{};
+	constexpr int CLASS_COUNT = SMALL_CLASS_COUNT + LARGE_CLASS_COUNT;
+	ret.classes.resize(CLASS_COUNT);
+	struct Counts
+	{
+		uint64_t allocations, frees, poolAllocations, poolFrees;
+	};
+	std::array<Counts, CLASS_COUNT> counts{};
+	auto add = [](Counts& to, const SizeClassCounters& from) {
+		to.allocations += from.allocations.load(std::memory_order_relaxed);
+		to.frees += from.frees.load(std::memory_order_relaxed);
+		to.poolAllocations += from.poolAllocations.load(std::memory_order_relaxed);
+		to.poolFrees += from.poolFrees.load(std::memory_order_relaxed);
+	};
+	{
+		// held so that a cache being released is counted exactly once
+		std::lock_guard<std::mutex> lock(threadCacheMutex);
+		for (int i = 0; i < CLASS_COUNT; i++)
+		{
+			const bool isSmallPool = i < SMALL_CLASS_COUNT;
+			const int index = isSmallPool ? i : i - SMALL_CLASS_COUNT;
+			add(counts[i], isSmallPool ? smallCounters[index] : largeCounters[index]);
+			for (ThreadCache* cache = threadCaches; cache != nullptr; cache = cache->nextOfManager)
+				add(counts[i], cache->counters(isSmallPool, index));
+			for (int cpu = 0; cpu < perCpuCache.cpus(); cpu++)
+				add(counts[i], perCpuCache.counters(cpu, isSmallPool, index));
+		}
+		ret.crossNodeFrees = crossNodeFrees.load(std::memory_order_relaxed);
+		for (ThreadCache* cache = threadCaches; cache != nullptr; cache = cache->nextOfManager)
+			ret.crossNodeFrees += cache->crossNodeFrees.load(std::memory_order_relaxed);
+		for (int cpu = 0; cpu < perCpuCache.cpus(); cpu++)
+			ret.crossNodeFrees += perCpuCache.crossNodeFrees(cpu);
+	}
+	for (int i = 0; i < CLASS_COUNT; i++)
+	{
+		const bool isSmallPool = i < SMALL_CLASS_COUNT;
+		const int index = isSmallPool ? i : i - SMALL_CLASS_COUNT;
+		SizeClassStats& stats = ret.classes[i];
+		stats.blockSize = isSmallPool ? SMALL_BLOCK_SIZES[index] : LARGE_BLOCK_SIZES[index];
+		stats.allocations = counts[i].allocations;
+		stats.frees = counts[i].frees;
+		// counters of different threads are read at slightly different moments
+		const int64_t live = (int64_t)(counts[i].allocations - counts[i].frees);
+		const int64_t fromPools = (int64_t)(counts[i].poolAllocations - counts[i].poolFrees);
+		stats.liveBlocks = (size_t)std::max<int64_t>(live, 0);
+		stats.cachedBlocks = (size_t)std::max<int64_t>(fromPools - live, 0);
+		stats.pools = (isSmallPool ? smallPoolCounts[index] : largePoolCounts[index]).load(std::memory_order_relaxed);
+		stats.poolBytes = stats.pools * (isSmallPool ? SMALL_POOL_SIZE : LARGE_POOL_SIZE);
+		stats.lockContentions = (isSmallPool ? smallMutexes[index] : largeMutexes[index]).contentions();
+		ret.liveBlockBytes += stats.liveBlocks * stats.blockSize;
+	}
+
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		HugeArena& arena = hugeArenas[i];
+		std::unique_lock<CountingSharedMutex> lock(arena.mutex);
+		ret.hugeAllocations += arena.hugeAllocations;
+		ret.hugeFrees += arena.hugeFrees;
+		for (MemoryListPool* pool = arena.pools; pool != nullptr; pool = pool->next)
+		{
+			ret.reservedBytes += pool->poolSize;
+			ret.freeBytes += pool->freeSpace;
+			ret.committedBytes += pool->poolSize - pool->purgedSpace;
+			// pages change type only under the arena lock
+			const size_t from = getPageNum(pool->baseAddress);
+			for (size_t pageNum = from; pageNum < from + pool->poolSize / PAGE_SIZE; pageNum++)
+			{
+				switch (pageMap.get(pageNum)->t)
+				{
+				case Page::PageType::HUGE: ret.hugePages++; break;
+				case Page::PageType::LARGE: ret.largePages++; break;
+				case Page::PageType::SMALL: ret.smallPages++; break;
+				default: assert(false);
+				}
+			}
+		}
+		ret.arenaLockContentions += arena.mutex.contentions();
+	}
+	ret.smallPagePoolLockContentions = smallPagePoolMutex.contentions();
+	{
+		std::unique_lock<CountingSharedMutex> lock(internalPoolMutex);
+		ret.internalPages = internalPool.poolSize / PAGE_SIZE;
+		ret.internalPoolBytes = internalPool.poolSize;
+		ret.internalPoolUsedBytes = internalPool.poolSize - internalPool.freeSpace;
+	}
+	ret.internalPoolLockContentions = internalPoolMutex.contentions();
+	ret.numaNodes = numaNodes;
+
+	// the bytes of the huge pools out of their free blocks hold block pool pages or huge blocks, which count as live
+	const size_t handedOut = ret.reservedBytes - ret.freeBytes;
+	const size_t blockPoolBytes = (ret.largePages + ret.smallPages) * PAGE_SIZE;
+	const size_t hugeBlockBytes = handedOut > blockPoolBytes ? handedOut - blockPoolBytes : 0;
+	if (handedOut > 0)
+		ret.fragmentation = std::max(0.0, 1 - (double)(ret.liveBlockBytes + hugeBlockBytes) / handedOut);
+	return ret;
+}
+
+void CustomMemoryManager::writeHeapProfile(std::ostream& out)
+{
+	heapProfiler.writeProfile(out, config.profileSampleBytes);
+}
+
+size_t CustomMemoryManager::purge(bool all)
+{
+	if (!all && config.purgeDecayMs < 0)
+		return 0;
+	const uint64_t decayMs = all ? 0 : config.purgeDecayMs;
+	size_t ret = 0;
+	for (int i = 0; i < hugeArenaCount; i++)
+	{
+		HugeArena& arena = hugeArenas[i];
+		std::unique_lock<CountingSharedMutex> lock(arena.mutex);
+		for (MemoryListPool* pool = arena.pools; pool != nullptr;)
+		{
+			MemoryListPool* next = pool->next;
+			ret += pool->purge(decayMs);
+			// a wholly free pool whose free block has decayed is unmapped altogether
+			if (pool->freeSpace == pool->poolSize && pool->purgedSpace != 0)
+			{
+				ret += pool->poolSize - pool->purgedSpace;
+				releaseHugePool(arena, pool);
+			}
+			pool = next;
+		}
+	}
+	return ret;
+}
+
+void CustomMemoryManager::releaseHugePool(HugeArena& arena, MemoryListPool* pool)
+{
+	const size_t from = (size_t)pool->baseAddress;
+	const size_t to = from + pool->poolSize - PAGE_SIZE;
+	for (size_t pageAddress = from; pageAddress <= to; pageAddress += PAGE_SIZE)
+	{
+		size_t pageNum = getPageNum(pageAddress);
+		Page* page = pageMap.get(pageNum);
+		assert(page != nullptr && page->t == Page::PageType::HUGE);
+		pageMap.set(pageNum, nullptr);
+		freeFromInternalPool(page);
+	}
+	MemoryListPool* prev = nullptr;
+	for (MemoryListPool* curr = arena.pools; curr != pool; curr = curr->next)
+		prev = curr;
+	(prev != nullptr ? prev->next : arena.pools) = pool->next;
+	if (arena.lastPool == pool)
+		arena.lastPool = prev;
+	// the next pool of the arena is sized as if the released one had never grown it
+	arena.nextPoolSize = std::max(arena.nextPoolSize / 2, INITIAL_HUGE_POOL_SIZE);
+	pool->~MemoryListPool();
+	freeFromInternalPool(pool);
+}
+
+void CustomMemoryManager::purgeLoop()
+{
+	const auto interval = std::chrono::milliseconds(std::max(config.purgeDecayMs / 2, 1));
+	std::unique_lock<std::mutex> lock(purgeMutex);
+	while (!purgeCondition.wait_for(lock, interval, [this]() { return isStopping; }))
+	{
+		lock.unlock();
+		purge();
+		lock.lock();
+	}
+}
@@ -9,24 +9,50 @@
 
 // lock order is always
 // block pool -> (page pool ->) list pool -> internal pool
+// the list pools are sharded into arenas with one lock each; a thread holds at most one arena lock
 
 #include "memory_pool.h"
+#include "size_classes.h"
+#include "thread_cache.h"
+#include "per_cpu_cache.h"
+#include "page_map.h"
+#include "stats.h"
+#include "heap_profiler.h"
+#include "hardening.h"
+#include "trace_recorder.h"
 
-#include <map>
-#include <list>
 #include <array>
 #include <vector>
 #include <atomic>
 #include <shared_mutex>
 #include <mutex>
-
-#include <Windows.h>
+#include <thread>
+#include <condition_variable>
 
 class MemoryManager
 {
 public:
+	virtual ~MemoryManager() = default;
 	virtual void* allocate(size_t size) = 0;
 	virtual void free(void* ptr) = 0;
+	// resizes the block at ptr, in place if possible, keeping its contents up to the smaller size
+	// ptr == nullptr allocates, size == 0 frees and returns nullptr
+	virtual void* reallocate(void* ptr, size_t size) = 0;
+	// bytes usable at ptr, at least the size it was allocated with
+	virtual size_t usableSize(void* ptr) = 0;
+	// size is the one ptr was allocated or last reallocated with
+	virtual void free(void* ptr, size_t) { free(ptr); }
+	// count blocks of size bytes
+	virtual void allocateBatch(size_t size, int count, void** blocks)
+	{
+		for (int i = 0; i < count; i++)
+			blocks[i] = allocate(size);
+	}
+	virtual void freeBatch(void** blocks, int count)
+	{
+		for (int i = 0; i < count; i++)
+			free(blocks[i]);
+	}
 	virtual size_t reportFreeSpace() = 0;
 	virtual size_t reportTotalSpace() = 0;
 };
@@ -37,26 +63,21 @@ namespace CustomMemoryManagerConstants
 	constexpr size_t INTERNAL_POOL_SIZE = 32 * (1 << 20);
 	constexpr size_t INITIAL_HUGE_POOL_SIZE = 128 * (1 << 20);
 	constexpr int TOTAL_PAGE_NUM = MAX_MEMORY >> 21;
-	constexpr size_t SMALL_THRESHOLD = 512;
-	constexpr size_t LARGE_THRESHOLD = 256 * (1 << 10);
 	constexpr size_t SMALL_POOL_SIZE = 4 * (1 << 10);
 	constexpr size_t LARGE_POOL_SIZE = 2 * (1 << 20);
 	constexpr size_t SMALL_PAGE_NUM_PER_LARGE_PAGE = LARGE_POOL_SIZE / SMALL_POOL_SIZE;
-	const std::array<size_t, 23> SMALL_BLOCK_SIZES
-		= {
-			8, 16, 24, 32, 40, 48, 56, 64, 72, 88, 104, 120, 136,
-			160, 184, 208, 240, 272, 312, 352, 400, 456, 512
-	};
-	const std::array<size_t, 53> LARGE_BLOCK_SIZES
-		= {
-			576, 648, 736, 832, 936, 1056, 1192, 1344, 1512, 1704, 1920,
-			2160, 2432, 2736, 3080, 3472, 3912, 4408, 4960, 5584, 6288,
-			7080, 7968, 8968, 10096, 11360, 12784, 14384, 16184, 18208,
-			20488, 23056, 25944, 29192, 32848, 36960, 41584, 46784, 52632,
-			59216, 66624, 74952, 84328, 94872, 106736, 120080, 135096,
-			151984, 170984, 192360, 216408, 243464, 262144
-	};
+	// the densest classes, to which the bitmap at the front of a pool costs at most one block in 64
+	constexpr int MAX_BITMAP_BLOCK_SIZE = 64;
+	// the size classes are in size_classes.h
 	constexpr size_t PAGE_SIZE = LARGE_POOL_SIZE;
+	// huge blocks from this size on are moved by remapping their pages when they cannot grow in place
+	constexpr size_t MIN_REMAP_SIZE = 1 << 20;
+	// threads are spread round-robin over the arenas of the huge tier, which are split evenly over the NUMA nodes
+	constexpr int MAX_HUGE_ARENAS = 8;
+	// nodes past it share the pools of another node
+	constexpr int MAX_NUMA_NODES = 8;
+	// threads seldom move between nodes, so a thread's node is looked up again only every this many uses
+	constexpr int NUMA_NODE_REFRESH_INTERVAL = 1024;
 	//std::vector<size_t> CustomMemoryManager::makeBlockSizes(int min, int max)
 	//{
 	//	std::vector<size_t> ret;
@@ -74,12 +95,44 @@ namespace CustomMemoryManagerConstants
 	//}
 	size_t getPageNum(size_t ptr);
 	size_t getPageNum(void* ptr);
-	int getPageHash(size_t ptr);
-	int getPageHash(void* ptr);
 	int getSmallPageNum(size_t ptr);
 	int getSmallPageNum(void* ptr);
 }
 
+struct CustomMemoryManagerConfig
+{
+	// back the huge pools with MAP_HUGETLB pages, or transparent huge pages if none are reserved
+	bool useHugePages = false;
+	// free runs of the huge pools of at least 2 MiB, and wholly free huge pools, unused for this long are returned to the OS by purge()
+	int purgeDecayMs = 10'000;
+	// purge from a background thread every purgeDecayMs / 2
+	bool backgroundPurge = false;
+	// pools of the classes up to MAX_BITMAP_BLOCK_SIZE track their blocks in a bitmap instead of a free list
+	// off by default, as bitmapPoolTest measures them no faster than the free lists
+	bool useBitmapPools = false;
+	// mean bytes allocated between two allocations sampled by the heap profiler; 0 turns the profiler off
+	// sampled blocks come from the huge pools, and sized frees then look the block up as plain frees do
+	size_t profileSampleBytes = 0;
+	// in the hardened build, unmapped pages on both sides of each huge block; the huge pools then use normal pages
+	bool useGuardPages = false;
+	// file to which every allocation and free is recorded, for replayTrace in benchmark.h; nullptr records nothing
+	// the events are written a buffer at a time, and a thread's last ones when it exits or the manager is destroyed
+	const char* tracePath = nullptr;
+	// the cached classes go through per-CPU instead of per-thread magazines, in the threads that have rseq;
+	// the others keep their thread caches
+	bool usePerCpuCaches = false;
+};
+
+struct HugePageStats
+{
+	// 2 MiB pages of the huge pools by backing
+	size_t hugetlbPages;
+	size_t transparentHugeAdvisedPages;
+	size_t transparentHugeResidentPages;
+	// block pool pages carved from hugetlb-backed huge pools
+	size_t hugetlbBlockPoolPages;
+};
+
 class Page
 {
 public:
@@ -89,6 +142,8 @@ public:
 	const PageType t;
 	const size_t pageNum;
 	MemoryListPool* const hugePool;
+	// of a LARGE or SMALL page, which its huge pool handed out whole, without a header in band
+	MemoryListPool::BoundaryTag poolTag{};
 	Page(PageType t, MemoryListPool* hugePool, size_t pageNum) :
 		t(t), hugePool(hugePool), pageNum(pageNum) {}
 };
@@ -97,7 +152,7 @@ class LargeBlockPoolPage : public Page
 {
 public:
 	MemoryBlockPool dataPool;
-	LargeBlockPoolPage(MemoryListPool* hugePool, size_t pageNum, CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, std::list<MemoryBlockPool*>& freePools) :
+	LargeBlockPoolPage(MemoryListPool* hugePool, size_t pageNum, CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, BlockPoolQueue& freePools) :
 		Page(PageType::LARGE, hugePool, pageNum), dataPool{ manager, baseAddress, poolSize, blockSize, freePools } {}
 };
 
@@ -106,51 +161,207 @@ class SmallBlockPoolPage : public Page
 public:
 	MemoryBlockPool dataPool;
 	std::array<MemoryBlockPool*, CustomMemoryManagerConstants::SMALL_PAGE_NUM_PER_LARGE_PAGE> smallPools{};
-	SmallBlockPoolPage(MemoryListPool* hugePool, size_t pageNum, CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, std::list<MemoryBlockPool*>& freePools) :
+	SmallBlockPoolPage(MemoryListPool* hugePool, size_t pageNum, CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, BlockPoolQueue& freePools) :
 		Page(PageType::SMALL, hugePool, pageNum), dataPool{ manager, baseAddress, poolSize, blockSize, freePools } {}
 };
 
+// one shard of the huge tier; its list pools grow independently of the other arenas
+struct HugeArena
+{
+	CountingSharedMutex mutex;
+	// whose threads the arena serves, and where its pools' pages are placed
+	int node = 0;
+	// linked through MemoryListPool::next, oldest first
+	MemoryListPool* pools = nullptr;
+	MemoryListPool* lastPool = nullptr;
+	size_t nextPoolSize = CustomMemoryManagerConstants::INITIAL_HUGE_POOL_SIZE;
+	// of the blocks over LARGE_THRESHOLD, counted by the arena owning them
+	uint64_t hugeAllocations = 0;
+	uint64_t hugeFrees = 0;
+};
+
 class CustomMemoryManager : public MemoryManager
 {
 public:
 	void* allocate(size_t size) override final;
 	void free(void* ptr) override final;
+	// a block not of the class of size, e.g. one from allocateAligned, is found out through the page map and freed as by free
+	void free(void* ptr, size_t size) override final;
+	// block classes are served a chain at a time, each taken from a pool with a single CAS
+	void allocateBatch(size_t size, int count, void** blocks) override final;
+	// each run of blocks from one pool goes back with a single CAS
+	void freeBatch(void** blocks, int count) override final;
+	void* reallocate(void* ptr, size_t size) override final;
+	// in the hardened build, short of the canary
+	size_t usableSize(void* ptr) override final;
+	// alignment is a power of two
+	// the block may be rounded up within a larger class; free, reallocate and usableSize take any address within a block
+	void* allocateAligned(size_t size, size_t alignment);
 	size_t reportFreeSpace() override final;
+	// reserved bytes of the huge pools
 	size_t reportTotalSpace() override final;
-	CustomMemoryManager();
+	// reserved bytes minus the purged pages
+	size_t reportCommittedSpace();
+	HugePageStats reportHugePages();
+	// per size class and per page type, collected from the per-thread counters and the pools
+	MemoryStats reportStats();
+	// the live sampled allocations by call stack, in the legacy pprof heap profile format
+	void writeHeapProfile(std::ostream& out);
+	// whether the calling thread's cached classes go through the per-CPU caches
+	bool hasPerCpuCaches() const { return perCpuCache.isActive(); }
+	// returns free memory unused for purgeDecayMs, or all free memory, to the OS; returns the bytes released
+	size_t purge(bool all = false);
+	CustomMemoryManager(const CustomMemoryManagerConfig& config = CustomMemoryManagerConfig());
 	~CustomMemoryManager();
 
 private:
-	std::array<std::list<MemoryBlockPool*>, 23> freeSmallPools{};
-	std::array<std::list<MemoryBlockPool*>, 53> freeLargePools{};
-	std::array<std::shared_mutex, 23> smallMutexes{};
-	std::array<std::shared_mutex, 53> largeMutexes{};
+	const CustomMemoryManagerConfig config;
+	// mixed into the canaries and huge block tags of the hardened build, so that stale or forged ones fail the check
+	const uint64_t canarySecret;
+
+	// by NUMA node, so that a thread takes blocks from pools on its own node
+	std::array<std::array<BlockPoolQueue, CustomMemoryManagerConstants::SMALL_CLASS_COUNT>, CustomMemoryManagerConstants::MAX_NUMA_NODES> freeSmallPools{};
+	std::array<std::array<BlockPoolQueue, CustomMemoryManagerConstants::LARGE_CLASS_COUNT>, CustomMemoryManagerConstants::MAX_NUMA_NODES> freeLargePools{};
+	std::array<CountingSharedMutex, CustomMemoryManagerConstants::SMALL_CLASS_COUNT> smallMutexes{};
+	std::array<CountingSharedMutex, CustomMemoryManagerConstants::LARGE_CLASS_COUNT> largeMutexes{};
+	// changed under the class locks
+	std::array<std::atomic<int>, CustomMemoryManagerConstants::SMALL_CLASS_COUNT> smallPoolCounts{};
+	std::array<std::atomic<int>, CustomMemoryManagerConstants::LARGE_CLASS_COUNT> largePoolCounts{};
+	// the counts of the allocations and frees made without a thread cache, and of the caches already released
+	std::array<SizeClassCounters, CustomMemoryManagerConstants::SMALL_CLASS_COUNT> smallCounters;
+	std::array<SizeClassCounters, CustomMemoryManagerConstants::LARGE_CLASS_COUNT> largeCounters;
+	// the live thread caches, linked through ThreadCache::nextOfManager
+	std::mutex threadCacheMutex;
+	ThreadCache* threadCaches = nullptr;
+	PerCpuCache perCpuCache;
+
+	HeapProfiler heapProfiler;
+	BlockQuarantine quarantine;
+	TraceRecorder traceRecorder;
 	
-	std::shared_mutex smallPagePoolMutex;
-	std::list<MemoryBlockPool*> freeSmallBlockPoolPages;
+	CountingSharedMutex smallPagePoolMutex;
+	std::array<BlockPoolQueue, CustomMemoryManagerConstants::MAX_NUMA_NODES> freeSmallBlockPoolPages{};
 
-	std::shared_mutex hugePoolsMutex;
-	std::vector<MemoryListPool*> hugePools;
-	std::array<std::vector<Page*>, CustomMemoryManagerConstants::TOTAL_PAGE_NUM> pages{};
-	size_t nextHugePoolSize = CustomMemoryManagerConstants::INITIAL_HUGE_POOL_SIZE;
+	const int numaNodes;
+	const int arenasPerNode;
+	const int hugeArenaCount;
+	// frees of blocks whose pages are on another node than the freeing thread's, made without a thread cache,
+	// and of the caches already released; guarded by threadCacheMutex but for the uncached ones
+	std::atomic<uint64_t> crossNodeFrees{ 0 };
+	std::array<HugeArena, CustomMemoryManagerConstants::MAX_HUGE_ARENAS> hugeArenas;
+	PageMap pageMap;
+	std::atomic<size_t> hugetlbBlockPoolPages{ 0 };
 
-	std::shared_mutex internalPoolMutex;
+	CountingSharedMutex internalPoolMutex;
 	MemoryListPool internalPool;
 
+	std::thread purgeThread;
+	std::mutex purgeMutex;
+	std::condition_variable purgeCondition;
+	bool isStopping = false;
+
 private:
-	void grow();
+	// arena lock must be held
+	void grow(HugeArena& arena, int arenaIndex);
+	int currentArenaIndex();
+	// the calling thread's node, as of its last lookup
+	int currentNode();
+	void countCrossNodeFree(Page* page, int count = 1);
+	// the pool must be wholly free; arena lock must be held
+	void releaseHugePool(HugeArena& arena, MemoryListPool* pool);
+	void purgeLoop();
 
-	void* allocateFromBlockPool(std::shared_mutex& mutex, std::list<MemoryBlockPool*>& pools, bool isSmallPool, int blockSize);
-	void* allocateFromListPool(size_t size);
+	void* allocateUnsampled(size_t size);
+	// the rest of free, past the quarantine of the hardened build
+	void freeNow(void* ptr);
+	// nullptr if the allocation is not to be sampled after all
+	void* allocateSampled(size_t size, size_t alignment);
+	void* allocateFromBlockPool(CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, int blockSize);
+	int allocateBatchFromBlockPool(CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, int blockSize, void** blocks, int count);
+	// the block starts offset bytes past a multiple of alignment; in the hardened build, offset must be 0
+	void* allocateFromListPool(size_t size, size_t alignment, size_t offset = 0);
+	void* allocateFromArena(size_t size, size_t alignment, size_t offset);
+	void* reallocateFromListPool(void* ptr, size_t size, MemoryListPool* pool);
 	void* allocateFromInternalPool(size_t size);
-	MemoryBlockPool* allocateSmallPage(int blockSize, std::list<MemoryBlockPool*>& pools);
-	MemoryBlockPool* allocateLargeBlockPoolPage(int blockSize, std::list<MemoryBlockPool*>& pools);
+	MemoryBlockPool* allocateSmallPage(int blockSize, BlockPoolQueue& pools);
+	MemoryBlockPool* allocateLargeBlockPoolPage(int blockSize, BlockPoolQueue& pools);
 	MemoryBlockPool* allocateSmallBlockPoolPage();
-	MemoryBlockPool* allocatePage(bool forSmallPages, int blockSize, std::list<MemoryBlockPool*>& pools);
+	MemoryBlockPool* allocatePage(bool forSmallPages, int blockSize, BlockPoolQueue& pools);
 
-	void freeFromBlockPool(void* ptr, MemoryBlockPool* pool, std::shared_mutex& mutex, std::list<MemoryBlockPool*>& pools, bool isSmallPool);
+	// isPagePool for the pools of the 4 KiB pages, which are no size class
+	void freeFromBlockPool(void* ptr, MemoryBlockPool* pool, CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, bool isPagePool = false);
+	// count blocks of one pool, returned with a single CAS
+	void freeBatchToBlockPool(void** blocks, int count, MemoryBlockPool* pool, CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool);
+	// requeues or releases the pool after blocks including ptr came back; poolSize and blockSize are read before the free
+	void onBlockPoolFreed(void* ptr, MemoryBlockPool* pool, size_t poolSize, int blockSize, size_t freeSpace, CountingSharedMutex& mutex, BlockPoolQueue& pools, bool isSmallPool, bool isPagePool = false);
+	bool isLiveBlockPool(void* ptr, MemoryBlockPool* pool, int blockSize);
 	void freeFromListPool(void* ptr, MemoryListPool* pool);
 	void freeFromInternalPool(void* ptr);
 	void freeSmallPage(void* ptr);
 	void freePage(void* ptr);
+
+	// hardened build
+	uint64_t canaryOf(void* block) const;
+	// sets the canary of a block of a block pool that is being handed out
+	void* armBlock(void* block, size_t blockSize)
+	{
+		if constexpr (HardeningConstants::IS_HARDENED)
+			*(uint64_t*)((size_t)block + blockSize - HardeningConstants::CANARY_SIZE) = canaryOf(block);
+		return block;
+	}
+	// checks, poisons and queues a block being freed; returns the blocks to free now, which are checked as well
+	int quarantineBlock(void* ptr, void** evicted);
+	// a huge block between its tag and, with guard pages, the guards; the list pool block sits under the tag
+	void* allocateTaggedBlock(size_t size, size_t alignment);
+	// checks the tag and drops the guards; returns the list pool block
+	void* untagBlock(void* ptr);
+	size_t taggedBlockSize(void* ptr);
+
+	// records an operation of the calling thread, in its trace buffer if it has one
+	void trace(TraceOp op, void* ptr, uint64_t argument, size_t size);
+
+	Page* findPage(void* ptr);
+	MemoryBlockPool* findBlockPool(void* ptr);
+	// where a huge pool keeps the boundary tag of the page at ptr, or nullptr if the page is not handed out whole
+	MemoryListPool::BoundaryTag* wholePageTag(void* ptr)
+	{
+		Page* page = pageMap.get(ptr);
+		if (page == nullptr || (page->t != Page::PageType::LARGE && page->t != Page::PageType::SMALL))
+			return nullptr;
+		return &page->poolTag;
+	}
+
+	// the per-CPU or thread cache of the calling thread; nullptr or false sends the block to or from the pools
+	void* allocateCached(bool isSmallPool, int index)
+	{
+		if (perCpuCache.isActive())
+			return perCpuCache.allocate(isSmallPool, index);
+		ThreadCache* cache = ThreadCache::get(this);
+		if (cache != nullptr)
+			return cache->allocate(isSmallPool, index);
+		countUncached(isSmallPool, index, 1, 0);
+		return nullptr;
+	}
+	bool freeCached(void* ptr, bool isSmallPool, int index)
+	{
+		if (perCpuCache.isActive())
+			return perCpuCache.free(ptr, isSmallPool, index);
+		ThreadCache* cache = ThreadCache::get(this);
+		if (cache != nullptr)
+			return cache->free(ptr, isSmallPool, index);
+		countUncached(isSmallPool, index, 0, 1);
+		return false;
+	}
+
+	// thread cache interface
+	ThreadCache* allocateThreadCache();
+	void freeThreadCache(ThreadCache* cache);
+	int allocateBlocks(bool isSmallPool, int index, void** blocks, int count);
+	void freeBlocks(bool isSmallPool, int index, void** blocks, int count);
+	// for the blocks that go to and from the pools without a thread cache
+	void countUncached(bool isSmallPool, int index, int allocations, int frees);
+
+	friend ThreadCache;
+	friend PerCpuCache;
+	friend MemoryListPool;
 };
\ No newline at end of file
@@ -2,175 +2,656 @@
 
 #include "memory_manager.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <iostream>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace MemoryBlockPoolConstants;
+using namespace MemoryListPoolConstants;
+
 constexpr size_t multipleGeq(size_t size, size_t multiple) {
 	return (size + multiple - 1) / multiple * multiple;
 }
 
-MemoryBlockPool::MemoryBlockPool(CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, std::list<MemoryBlockPool*>& freePools) :
+void BlockPoolQueue::pushBack(MemoryBlockPool* pool)
+{
+	pool->prevOnQueue = tail;
+	pool->nextOnQueue = nullptr;
+	if (tail != nullptr)
+		tail->nextOnQueue = pool;
+	else
+		head = pool;
+	tail = pool;
+}
+
+void BlockPoolQueue::popFront()
+{
+	erase(head);
+}
+
+void BlockPoolQueue::erase(MemoryBlockPool* pool)
+{
+	if (pool->prevOnQueue != nullptr)
+		pool->prevOnQueue->nextOnQueue = pool->nextOnQueue;
+	else
+		head = pool->nextOnQueue;
+	if (pool->nextOnQueue != nullptr)
+		pool->nextOnQueue->prevOnQueue = pool->prevOnQueue;
+	else
+		tail = pool->prevOnQueue;
+}
+
+MemoryBlockPool::MemoryBlockPool(CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, BlockPoolQueue& freePools, bool useBitmap) :
 	MemoryPool(manager, true), baseAddress(baseAddress), poolSize(poolSize), blockSize(blockSize),
-	numBlock((poolSize - multipleGeq(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT))
-		/ (blockSize + multipleGeq(sizeof(SLIST_ENTRY), MEMORY_ALLOCATION_ALIGNMENT))),
-	freeHead((PSLIST_HEADER)baseAddress),
-	slistAddress((size_t)baseAddress + multipleGeq(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT)),
+	classIndex((size_t)blockSize <= CustomMemoryManagerConstants::SMALL_THRESHOLD
+		? CustomMemoryManagerConstants::SmallSizeClasses::index(blockSize) : CustomMemoryManagerConstants::LargeSizeClasses::index(blockSize)),
+	usesBitmap(useBitmap),
+	freePools(&freePools),
+	numBlock((poolSize - (useBitmap ? BITMAP_SIZE : 0)) / blockSize),
 	dataAddress((size_t)baseAddress + poolSize - blockSize * numBlock),
-	freeSpace(poolSize)
+	reciprocal(((uint64_t)1 << RECIPROCAL_SHIFT) / blockSize + 1),
+	bitmap(useBitmap ? (std::atomic<uint64_t>*)baseAddress : nullptr),
+	bumpIndex(0)
 {
-	InitializeSListHead(freeHead);
-	size_t metaAddress = slistAddress;
-	for (int i = 0; i < numBlock; i++) {
-		PSLIST_ENTRY listEntry = (PSLIST_ENTRY)metaAddress;
-		InterlockedPushEntrySList(freeHead, listEntry);
-		metaAddress += multipleGeq(sizeof(SLIST_ENTRY), MEMORY_ALLOCATION_ALIGNMENT);
+	assert((size_t)poolSize <= CustomMemoryManagerConstants::LARGE_POOL_SIZE && ((size_t)blockSize >> (RECIPROCAL_SHIFT - 21)) == 0);
+	if (useBitmap)
+	{
+		assert(numBlock <= BITMAP_BITS && (size_t)baseAddress % 32 == 0);
+		for (int i = 0; i < BITMAP_WORDS; i++)
+		{
+			int bits = std::max(0, std::min(64, numBlock - 64 * i));
+			new (&bitmap[i]) std::atomic<uint64_t>(bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1);
+		}
 	}
 	isOnQueue = true;
-	freePools.push_back(this);
-	it = --freePools.end();
+	freePools.pushBack(this);
 }
 
-void* MemoryBlockPool::allocate(size_t size)
+size_t MemoryBlockPool::blockIndex(void* ptr) const
 {
-	PSLIST_ENTRY listEntry = InterlockedPopEntrySList(freeHead);
-	if (listEntry == nullptr)
-		return nullptr;
-	int index = ((size_t)listEntry - slistAddress) / multipleGeq(sizeof(SLIST_ENTRY), MEMORY_ALLOCATION_ALIGNMENT);
-	freeSpace.fetch_sub(blockSize);
-	return (void*)(dataAddress + blockSize * index);
+	return ((size_t)ptr - dataAddress) * reciprocal >> RECIPROCAL_SHIFT;
 }
 
-size_t MemoryBlockPool::free(void* ptr)
+void* MemoryBlockPool::blockStart(void* ptr) const
 {
-	int index = ((size_t)ptr - dataAddress) / blockSize;
-	InterlockedPushEntrySList(freeHead, (PSLIST_ENTRY)(slistAddress + multipleGeq(sizeof(SLIST_ENTRY), MEMORY_ALLOCATION_ALIGNMENT) * index));
-	size_t prevFreeSpace = freeSpace.fetch_add(blockSize);
-	return prevFreeSpace + blockSize;
+	return (void*)(dataAddress + blockSize * blockIndex(ptr));
 }
 
-MemoryListPool::MemoryListPool(CustomMemoryManager* manager, size_t poolSize):
-	MemoryPool(manager, false), poolSize(poolSize), freeSpace(poolSize),
-	baseAddress(_aligned_malloc(poolSize, CustomMemoryManagerConstants::PAGE_SIZE))
+size_t MemoryBlockPool::currentFreeSpace() const
 {
-	entryList.emplace_front(baseAddress, poolSize, true);
-	freeList.push_front(entryList.begin());
-	entryList.front().freeListIt = freeList.begin();
+	int freeBlocks = 0;
+	if (usesBitmap)
+	{
+		for (int i = 0; i < BITMAP_WORDS; i++)
+			freeBlocks += Platform::popCount(bitmap[i].load(std::memory_order_relaxed));
+	}
+	else
+		freeBlocks = freeHead.size() + remoteFreeHead.size() + freshBlocks();
+	return poolSize - (size_t)(numBlock - freeBlocks) * blockSize;
 }
 
-MemoryListPool::~MemoryListPool() {
-	_aligned_free(baseAddress);
+namespace
+{
+	// bit i is set if word i of the bitmap has a free block
+	// a torn snapshot only makes a caller skip or revisit a word; taking a block is always checked by the atomic
+	int nonEmptyWords(const std::atomic<uint64_t>* bitmap)
+	{
+#if defined(__AVX2__)
+		static_assert(BITMAP_WORDS == 8, "the bitmap is scanned as two 256-bit vectors");
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i low = _mm256_load_si256((const __m256i*)bitmap);
+		__m256i high = _mm256_load_si256((const __m256i*)bitmap + 1);
+		int empty = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(low, zero)))
+			| _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(high, zero))) << 4;
+		return ~empty & 0xff;
+#else
+		int ret = 0;
+		for (int i = 0; i < BITMAP_WORDS; i++)
+		{
+			if (bitmap[i].load(std::memory_order_relaxed) != 0)
+				ret |= 1 << i;
+		}
+		return ret;
+#endif
+	}
 }
 
-void* MemoryListPool::allocate(size_t size)
+int MemoryBlockPool::takeFromBitmap(void** blocks, int count)
 {
-	// std::cout << "enter allocate: " << entryList.size() << "=" << freeList.size() << "+" << usedMap.size() << std::endl;
-	assert(entryList.size() == freeList.size() + usedMap.size());
-
-	for(auto freeListIt = freeList.begin(); freeListIt != freeList.end(); freeListIt++)
+	int allocated = 0;
+	for (int words = nonEmptyWords(bitmap); words != 0 && allocated < count; words &= words - 1)
 	{
-		if ((*freeListIt)->size >= size)
+		const int word = Platform::countTrailingZeros(words);
+		uint64_t bits = bitmap[word].load(std::memory_order_relaxed);
+		while (bits != 0 && allocated < count)
 		{
-			auto it = *freeListIt;
-			freeSpace -= size;
-			size_t leftover = it->size - size;
-			if (leftover > 0)
+			// the lowest free blocks of the word, as many as still needed
+			uint64_t wanted = 0;
+			for (int i = allocated; i < count && bits != 0; i++)
 			{
-				auto it2 = entryList.insert(it, Entry(it->address, size, false));
-				usedMap[it2->address] = it2;
-				it->address = (void*)((size_t)it->address + size);
-				it->size = leftover;
-				return it2->address;
+				wanted |= bits & (~bits + 1);
+				bits &= bits - 1;
 			}
-			else
+			uint64_t prev = bitmap[word].fetch_and(~wanted, std::memory_order_acquire);
+			// blocks taken by others in the meantime are just skipped
+			for (uint64_t taken = prev & wanted; taken != 0; taken &= taken - 1)
+				blocks[allocated++] = (void*)(dataAddress + (size_t)blockSize * (64 * word + Platform::countTrailingZeros(taken)));
+			bits = prev & ~wanted;
+		}
+	}
+	return allocated;
+}
+
+size_t MemoryBlockPool::returnToBitmap(void** blocks, int count)
+{
+	// another thread may release the pool as soon as the last block is back, so nothing of it is read after that;
+	// the words other than the last one written are counted just before it
+	const size_t totalBlocks = numBlock;
+	const size_t fullSpace = poolSize;
+	const size_t size = blockSize;
+	int i = 0;
+	while (true)
+	{
+		const int word = (int)(blockIndex(blocks[i]) / 64);
+		uint64_t bits = 0;
+		for (; i < count && blockIndex(blocks[i]) / 64 == (size_t)word; i++)
+			bits |= (uint64_t)1 << (blockIndex(blocks[i]) % 64);
+		size_t freeBlocks = 0;
+		if (i == count)
+		{
+			for (int other = 0; other < BITMAP_WORDS; other++)
 			{
-				freeList.erase(freeListIt);
-				it->isOnFreeList = false;
-				usedMap[it->address] = it;
-				return it->address;
+				if (other != word)
+					freeBlocks += Platform::popCount(bitmap[other].load(std::memory_order_relaxed));
 			}
 		}
+		uint64_t prev = bitmap[word].fetch_or(bits, std::memory_order_release);
+		// double free
+		assert((prev & bits) == 0);
+		if (i == count)
+			return fullSpace - (totalBlocks - freeBlocks - Platform::popCount(prev | bits)) * size;
+	}
+}
+
+size_t MemoryBlockPool::usableSize(void* ptr) const
+{
+	return (size_t)blockStart(ptr) + blockSize - (size_t)ptr;
+}
+
+int MemoryBlockPool::freshBlocks() const
+{
+	return std::max(0, numBlock - bumpIndex.load(std::memory_order_relaxed));
+}
+
+int MemoryBlockPool::allocateFresh(void** blocks, int count)
+{
+	if (bumpIndex.load(std::memory_order_relaxed) >= numBlock)
+		return 0;
+	// may overshoot numBlock by a few concurrent callers, which then take nothing
+	int index = bumpIndex.fetch_add(count, std::memory_order_relaxed);
+	int allocated = std::max(0, std::min(count, numBlock - index));
+	for (int i = 0; i < allocated; i++)
+		blocks[i] = (void*)(dataAddress + (size_t)blockSize * (index + i));
+	return allocated;
+}
+
+void* MemoryBlockPool::allocate(size_t size)
+{
+	if (usesBitmap)
+	{
+		void* ptr;
+		return takeFromBitmap(&ptr, 1) == 1 ? ptr : nullptr;
 	}
+	// recently freed blocks first, as they are likely still cached
+	AtomicStack::Entry* listEntry = freeHead.pop();
+	if (listEntry != nullptr)
+		return listEntry;
+	void* ptr;
+	if (drainRemote(&ptr, 1) == 1 || allocateFresh(&ptr, 1) == 1)
+		return ptr;
 	return nullptr;
 }
 
-size_t MemoryListPool::free(void* ptr)
+int MemoryBlockPool::allocateBatch(void** blocks, int count)
 {
-	// std::cout << "enter free: " << entryList.size() << "=" << freeList.size() << "+" << usedMap.size() << std::endl;
-	assert(entryList.size() == freeList.size() + usedMap.size());
-
-	assert(usedMap.count(ptr));
-	auto mapIt = usedMap.find(ptr);
-	auto it = mapIt->second;
-	usedMap.erase(mapIt);
-	freeSpace += it->size;
-
-	if (it != entryList.begin()) {
-		auto prev = it;
-		prev--;
-		if (prev->isOnFreeList) {
-			prev->size += it->size;
-			entryList.erase(it);
-			it = prev;
-		}
+	if (usesBitmap)
+		return takeFromBitmap(blocks, count);
+	int allocated = count;
+	AtomicStack::Entry* listEntry = freeHead.popChain(allocated);
+	for (int i = 0; i < allocated; i++, listEntry = listEntry->next)
+		blocks[i] = listEntry;
+	if (allocated < count)
+		allocated += drainRemote(blocks + allocated, count - allocated);
+	if (allocated < count)
+		allocated += allocateFresh(blocks + allocated, count - allocated);
+	return allocated;
+}
+
+int MemoryBlockPool::drainRemote(void** blocks, int count)
+{
+	// the whole chain is taken at once, so pushers and the drainer never race on an entry
+	int drained;
+	AtomicStack::Entry* entry = remoteFreeHead.popAll(drained);
+	int allocated = 0;
+	for (; entry != nullptr && allocated < count; entry = entry->next)
+		blocks[allocated++] = entry;
+	// the rest moves to the shared stack; until then it is counted on neither list,
+	// which cannot hide an empty pool, as the blocks just taken are in use
+	if (entry != nullptr)
+	{
+		AtomicStack::Entry* last = entry;
+		while (last->next != nullptr)
+			last = last->next;
+		freeHead.pushChain(entry, last, drained - allocated);
 	}
+	return allocated;
+}
+
+size_t MemoryBlockPool::free(void* ptr)
+{
+	if (usesBitmap)
+		return returnToBitmap(&ptr, 1);
+	// the rest of the pool is counted first: once the block is back, another thread may release the pool
+	// two frees completing the pool through different lists at once may both miss that it is empty,
+	// which only keeps it queued for reuse
+	const size_t otherBlocks = remoteFreeHead.size() + freshBlocks();
+	const size_t totalBlocks = numBlock;
+	const size_t fullSpace = poolSize;
+	const size_t size = blockSize;
+	size_t listedBlocks = freeHead.push((AtomicStack::Entry*)blockStart(ptr));
+	return fullSpace - (totalBlocks - otherBlocks - listedBlocks) * size;
+}
+
+size_t MemoryBlockPool::freeRemote(void** blocks, int count)
+{
+	if (usesBitmap)
+		return returnToBitmap(blocks, count);
+	AtomicStack::Entry* first = (AtomicStack::Entry*)blockStart(blocks[0]);
+	AtomicStack::Entry* last = first;
+	for (int i = 1; i < count; i++)
 	{
-		auto next = it;
-		next++;
-		if (next != entryList.end() && next->isOnFreeList) {
-			next->size += it->size;
-			next->address = it->address;
-			if (it->isOnFreeList)
-				freeList.erase(it->freeListIt);
-			entryList.erase(it);
-			it = next;
-		}
+		last->next = (AtomicStack::Entry*)blockStart(blocks[i]);
+		last = last->next;
+	}
+	// counted first, as in free
+	const size_t otherBlocks = freeHead.size() + freshBlocks();
+	const size_t totalBlocks = numBlock;
+	const size_t fullSpace = poolSize;
+	const size_t size = blockSize;
+	size_t listedBlocks = remoteFreeHead.pushChain(first, last, count);
+	return fullSpace - (totalBlocks - otherBlocks - listedBlocks) * size;
+}
+
+namespace
+{
+	constexpr size_t FREE = 1;
+	constexpr size_t PREV_FREE = 2;
+	// the whole pages inside the free block have been handed back to the OS
+	constexpr size_t PURGED = 4;
+	constexpr size_t FLAGS = FREE | PREV_FREE | PURGED;
+	using CustomMemoryManagerConstants::PAGE_SIZE;
+
+	uint64_t nowMs()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+MemoryListPool::MemoryListPool(CustomMemoryManager* manager, size_t poolSize, bool useHugePages, int node):
+	MemoryPool(manager, false), node(node),
+	baseAddress(Platform::reservePages(poolSize, CustomMemoryManagerConstants::PAGE_SIZE, useHugePages, &backing)),
+	poolSize(poolSize), freeSpace(poolSize), firstLevelMap(0), secondLevelMaps{}, freeLists{}
+{
+	// before the header below touches the first page
+	if (node >= 0)
+		Platform::bindPages(baseAddress, poolSize, node);
+	static_assert(offsetof(BlockHeader, nextFree) == HEADER_SIZE, "payload must follow the header");
+	static_assert(offsetof(BlockHeader, sizeAndFlags) == offsetof(BoundaryTag, sizeAndFlags), "a boundary tag stands in for the header");
+	BlockHeader* block = (BlockHeader*)baseAddress;
+	block->sizeAndFlags = 0;
+	markFree(block, poolSize);
+	insertFree(block);
+}
+
+MemoryListPool::~MemoryListPool() {
+	Platform::releasePages(baseAddress, poolSize);
+}
+
+int MemoryListPool::binIndex(size_t size)
+{
+	if (size < SMALL_SIZE)
+		return (int)(size / (SMALL_SIZE / SL_COUNT));
+	int fl = Platform::log2Floor(size);
+	int sl = (int)(size >> (fl - SL_LOG2)) ^ SL_COUNT;
+	return (fl - FL_SHIFT + 1) * SL_COUNT + sl;
+}
+
+size_t MemoryListPool::roundUpToBin(size_t size)
+{
+	// every block in the bin of the rounded size is at least size
+	if (size < SMALL_SIZE)
+		return size;
+	return size + ((size_t)1 << (Platform::log2Floor(size) - SL_LOG2)) - 1;
+}
+
+int MemoryListPool::findBin(size_t size)
+{
+	int bin = binIndex(size);
+	int fl = bin / SL_COUNT;
+	uint32_t slMap = secondLevelMaps[fl] & (~0u << (bin % SL_COUNT));
+	if (slMap == 0)
+	{
+		uint32_t flMap = fl + 1 < FL_COUNT ? firstLevelMap & (~0u << (fl + 1)) : 0;
+		if (flMap == 0)
+			return -1;
+		fl = Platform::countTrailingZeros(flMap);
+		slMap = secondLevelMaps[fl];
+	}
+	return fl * SL_COUNT + Platform::countTrailingZeros(slMap);
+}
+
+void MemoryListPool::insertFree(BlockHeader* block)
+{
+	int bin = binIndex(block->sizeAndFlags & ~FLAGS);
+	block->prevFree = nullptr;
+	block->nextFree = freeLists[bin];
+	if (freeLists[bin] != nullptr)
+		freeLists[bin]->prevFree = block;
+	freeLists[bin] = block;
+	firstLevelMap |= 1u << (bin / SL_COUNT);
+	secondLevelMaps[bin / SL_COUNT] |= 1u << (bin % SL_COUNT);
+}
+
+void MemoryListPool::removeFree(BlockHeader* block)
+{
+	// reused pages count as committed again, though they are only faulted in when touched
+	if (block->sizeAndFlags & PURGED)
+	{
+		size_t from, to;
+		purgeableRange(block, from, to);
+		purgedSpace -= to - from;
+	}
+	int bin = binIndex(block->sizeAndFlags & ~FLAGS);
+	if (block->prevFree != nullptr)
+		block->prevFree->nextFree = block->nextFree;
+	else
+		freeLists[bin] = block->nextFree;
+	if (block->nextFree != nullptr)
+		block->nextFree->prevFree = block->prevFree;
+	if (freeLists[bin] == nullptr)
+	{
+		secondLevelMaps[bin / SL_COUNT] &= ~(1u << (bin % SL_COUNT));
+		if (secondLevelMaps[bin / SL_COUNT] == 0)
+			firstLevelMap &= ~(1u << (bin / SL_COUNT));
 	}
-	if (!it->isOnFreeList)
+}
+
+void MemoryListPool::markFree(BlockHeader* block, size_t size)
+{
+	block->sizeAndFlags = size | FREE | (block->sizeAndFlags & PREV_FREE);
+	if (size >= MIN_PURGEABLE_SIZE)
+		*freeSince(block) = nowMs();
+	size_t next = (size_t)block + size;
+	if (next < (size_t)baseAddress + poolSize)
 	{
-		freeList.push_front(it);
-		it->isOnFreeList = true;
-		it->freeListIt = freeList.begin();
+		BlockHeader* nextBlock = headerAt(next);
+		nextBlock->prevSize = size;
+		nextBlock->sizeAndFlags |= PREV_FREE;
 	}
+}
+
+void* MemoryListPool::take(BlockHeader* block, size_t address, size_t size)
+{
+	// carve [address, address + size) out of the free block, returning the rest to the free lists
+	// free blocks never neighbour each other, so the previous block is in use
+	removeFree(block);
+	size_t left = address - (size_t)block;
+	size_t right = (size_t)block + (block->sizeAndFlags & ~FLAGS) - address - size;
+	// a remainder too small to hold a free block stays with the allocation
+	if (right < MIN_BLOCK_SIZE)
+	{
+		size += right;
+		right = 0;
+	}
+	freeSpace -= size;
+
+	BlockHeader* used = (BlockHeader*)address;
+	used->sizeAndFlags = size;
+	if (left > 0)
+	{
+		block->sizeAndFlags = 0;
+		markFree(block, left);
+		insertFree(block);
+	}
+	size_t next = address + size;
+	if (right > 0)
+	{
+		BlockHeader* rest = (BlockHeader*)next;
+		rest->sizeAndFlags = 0;
+		markFree(rest, right);
+		insertFree(rest);
+	}
+	else if (next < (size_t)baseAddress + poolSize)
+		headerAt(next)->sizeAndFlags &= ~PREV_FREE;
+	return (void*)(address + HEADER_SIZE);
+}
+
+void* MemoryListPool::allocate(size_t size)
+{
+	size = std::max(multipleGeq(size + HEADER_SIZE, ALIGNMENT), MIN_BLOCK_SIZE);
 
-	assert(entryList.size() == freeList.size() + usedMap.size());
+	// good fit in O(1): the first non-empty bin whose blocks are all large enough
+	int bin = findBin(roundUpToBin(size));
+	if (bin >= 0)
+		return take(freeLists[bin], (size_t)freeLists[bin], size);
+	// the bin of the size itself may still hold a block that fits
+	for (BlockHeader* block = freeLists[binIndex(size)]; block != nullptr; block = block->nextFree)
+	{
+		if ((block->sizeAndFlags & ~FLAGS) >= size)
+			return take(block, (size_t)block, size);
+	}
+	return nullptr;
+}
+
+size_t MemoryListPool::free(void* ptr)
+{
+	BlockHeader* block = (BlockHeader*)((size_t)ptr - HEADER_SIZE);
+	assert(!(block->sizeAndFlags & FREE));
+	size_t size = block->sizeAndFlags & ~FLAGS;
+	freeSpace += size;
+
+	const size_t nextAddress = (size_t)block + size;
+	BlockHeader* next = nextAddress < (size_t)baseAddress + poolSize ? headerAt(nextAddress) : nullptr;
+	if (next != nullptr && (next->sizeAndFlags & FREE))
+	{
+		removeFree(next);
+		size += next->sizeAndFlags & ~FLAGS;
+	}
+	if (block->sizeAndFlags & PREV_FREE)
+	{
+		BlockHeader* prev = (BlockHeader*)((size_t)block - block->prevSize);
+		removeFree(prev);
+		size += block->prevSize;
+		block = prev;
+	}
+	markFree(block, size);
+	insertFree(block);
 	return freeSpace;
 }
 
+void* MemoryListPool::allocatePage(BoundaryTag& tag)
+{
+	void* ptr = allocateAligned(PAGE_SIZE);
+	if (ptr == nullptr)
+		return nullptr;
+	BlockHeader* block = (BlockHeader*)((size_t)ptr - HEADER_SIZE);
+	tag.prevSize = block->prevSize;
+	tag.sizeAndFlags = block->sizeAndFlags;
+	return block;
+}
+
+size_t MemoryListPool::freePage(void* page, const BoundaryTag& tag)
+{
+	BlockHeader* block = (BlockHeader*)page;
+	block->prevSize = tag.prevSize;
+	block->sizeAndFlags = tag.sizeAndFlags;
+	return free((void*)((size_t)page + HEADER_SIZE));
+}
+
+MemoryListPool::BlockHeader* MemoryListPool::headerAt(size_t address) const
+{
+	// only a page boundary can start a page handed out whole
+	if (address % PAGE_SIZE == 0)
+	{
+		BoundaryTag* tag = manager->wholePageTag((void*)address);
+		if (tag != nullptr)
+			return (BlockHeader*)tag;
+	}
+	return (BlockHeader*)address;
+}
+
+size_t MemoryListPool::usableSize(void* ptr) const
+{
+	BlockHeader* block = (BlockHeader*)((size_t)ptr - HEADER_SIZE);
+	return (block->sizeAndFlags & ~FLAGS) - HEADER_SIZE;
+}
+
 void* MemoryListPool::allocateAligned(size_t size)
 {
 	// aligned by size
-	for (auto freeListIt = freeList.begin(); freeListIt != freeList.end(); freeListIt++) {
-		auto it = *freeListIt;
-		size_t startAddress = ((size_t)it->address + size - 1) / size * size;
-		size_t endAddress = (size_t)it->address + it->size;
-		if(startAddress + size <= endAddress)
+	return allocateAt(size, size, 0);
+}
+
+void* MemoryListPool::allocate(size_t size, size_t alignment, size_t offset)
+{
+	if (alignment <= ALIGNMENT && offset == 0)
+		return allocate(size);
+	size = std::max(multipleGeq(size + HEADER_SIZE, ALIGNMENT), MIN_BLOCK_SIZE);
+	return allocateAt(size, alignment, HEADER_SIZE + (alignment - offset) % alignment);
+}
+
+bool MemoryListPool::resize(void* ptr, size_t size)
+{
+	BlockHeader* block = (BlockHeader*)((size_t)ptr - HEADER_SIZE);
+	const size_t current = block->sizeAndFlags & ~FLAGS;
+	size = std::max(multipleGeq(size + HEADER_SIZE, ALIGNMENT), MIN_BLOCK_SIZE);
+
+	size_t available = current;
+	const size_t nextAddress = (size_t)block + current;
+	BlockHeader* next = nextAddress < (size_t)baseAddress + poolSize ? headerAt(nextAddress) : nullptr;
+	if (next != nullptr && (next->sizeAndFlags & FREE))
+		available += next->sizeAndFlags & ~FLAGS;
+	if (available < size)
+		return false;
+	// a shrunk block's tail joins the free block after it
+	if (available > current)
+		removeFree(next);
+	size_t rest = available - size;
+	if (rest < MIN_BLOCK_SIZE)
+	{
+		size = available;
+		rest = 0;
+	}
+	freeSpace += current;
+	freeSpace -= size;
+
+	block->sizeAndFlags = size | (block->sizeAndFlags & PREV_FREE);
+	size_t end = (size_t)block + size;
+	if (rest > 0)
+	{
+		BlockHeader* tail = (BlockHeader*)end;
+		tail->sizeAndFlags = 0;
+		markFree(tail, rest);
+		insertFree(tail);
+	}
+	else if (end < (size_t)baseAddress + poolSize)
+		headerAt(end)->sizeAndFlags &= ~PREV_FREE;
+	return true;
+}
+
+void* MemoryListPool::allocateAt(size_t size, size_t alignment, size_t offset)
+{
+	// the block starts offset bytes before an aligned address
+	auto alignedAddress = [alignment, offset](BlockHeader* block) {
+		size_t address = multipleGeq((size_t)block + offset, alignment) - offset;
+		// a gap in front must be able to hold a free block
+		if (address != (size_t)block && address - (size_t)block < MIN_BLOCK_SIZE)
+			address += alignment;
+		return address;
+	};
+
+	auto fits = [size, alignedAddress](BlockHeader* block) {
+		return alignedAddress(block) + size <= (size_t)block + (block->sizeAndFlags & ~FLAGS);
+	};
+
+	// prefer a hole of about the right size, e.g. a released page, over splitting a large block
+	int probes = 0;
+	for (BlockHeader* block = freeLists[binIndex(size)]; block != nullptr; block = block->nextFree)
+	{
+		if (fits(block))
+			return take(block, alignedAddress(block), size);
+		if (++probes == ALIGNED_PROBE_COUNT)
+			break;
+	}
+	// any block of size + alignment + MIN_BLOCK_SIZE - ALIGNMENT bytes has room for an aligned block
+	size_t roomySize = size + alignment + MIN_BLOCK_SIZE - ALIGNMENT;
+	int bin = findBin(roundUpToBin(roomySize));
+	if (bin >= 0)
+		return take(freeLists[bin], alignedAddress(freeLists[bin]), size);
+	// smaller blocks fit only if they happen to be placed well
+	for (bin = binIndex(size); bin <= binIndex(roomySize); bin++)
+	{
+		for (BlockHeader* block = freeLists[bin]; block != nullptr; block = block->nextFree)
 		{
-			freeSpace -= size;
-			size_t left = startAddress - (size_t)it->address;
-			size_t right = endAddress - startAddress - size;
-			if (left > 0)
-			{
-				auto it2 = entryList.insert(it, Entry(it->address, left, true));
-				freeList.push_front(it2);
-				it2->freeListIt = freeList.begin();
-			}
-			if (right > 0)
-			{
-				it->address = (void*)(startAddress + size);
-				it->size = right;
-				auto it2 = entryList.insert(it, Entry((void*)startAddress, size, false));
-				usedMap[it2->address] = it2;
-				return it2->address;
-			}
-			else
-			{
-				it->address = (void*)startAddress;
-				freeList.erase(freeListIt);
-				it->isOnFreeList = false;
-				usedMap[it->address] = it;
-				return it->address;
-			}
+			if (fits(block))
+				return take(block, alignedAddress(block), size);
 		}
 	}
 	return nullptr;
-}
\ No newline at end of file
+}
+
+uint64_t* MemoryListPool::freeSince(BlockHeader* block)
+{
+	return (uint64_t*)((size_t)block + sizeof(BlockHeader));
+}
+
+void MemoryListPool::purgeableRange(BlockHeader* block, size_t& from, size_t& to) const
+{
+	// hugetlb pages are only ever dropped whole
+	const size_t pageSize = backing == Platform::PageBacking::HUGETLB ? PAGE_SIZE : Platform::SYSTEM_PAGE_SIZE;
+	// the header, links and timestamp at the front stay resident
+	from = multipleGeq((size_t)freeSince(block) + sizeof(uint64_t), pageSize);
+	to = ((size_t)block + (block->sizeAndFlags & ~FLAGS)) / pageSize * pageSize;
+	if (to < from)
+		to = from;
+}
+
+size_t MemoryListPool::purge(uint64_t decayMs)
+{
+	uint64_t now = nowMs();
+	size_t ret = 0;
+	for (int bin = binIndex(MIN_PURGEABLE_SIZE); bin < FL_COUNT * SL_COUNT; bin++)
+	{
+		for (BlockHeader* block = freeLists[bin]; block != nullptr; block = block->nextFree)
+		{
+			if ((block->sizeAndFlags & PURGED) || (block->sizeAndFlags & ~FLAGS) < MIN_PURGEABLE_SIZE
+				|| now - *freeSince(block) < decayMs)
+				continue;
+			size_t from, to;
+			purgeableRange(block, from, to);
+			if (from == to)
+				continue;
+			Platform::purgePages((void*)from, to - from);
+			block->sizeAndFlags |= PURGED;
+			purgedSpace += to - from;
+			ret += to - from;
+		}
+	}
+	return ret;
+}
@@ -1,11 +1,10 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <shared_mutex>
-#include <list>
-#include <map>
 
-#include <Windows.h>
+#include "platform.h"
 
 class CustomMemoryManager;
 class MemoryPool
@@ -25,6 +24,33 @@ protected:
 	friend CustomMemoryManager;
 };
 
+namespace MemoryBlockPoolConstants
+{
+	// offsets within a pool are divided by the block size as (offset * reciprocal) >> RECIPROCAL_SHIFT,
+	// exact for offsets below 2 MiB and block sizes below 2^(RECIPROCAL_SHIFT - 21)
+	constexpr int RECIPROCAL_SHIFT = 40;
+	// bitmap pools keep one bit per block, set while free, in a cache line at the front of the pool
+	constexpr int BITMAP_WORDS = 8;
+	constexpr int BITMAP_BITS = 64 * BITMAP_WORDS;
+	constexpr size_t BITMAP_SIZE = sizeof(uint64_t) * BITMAP_WORDS;
+}
+
+class MemoryBlockPool;
+
+// intrusive FIFO of block pools with free blocks, linked through the pools themselves
+// so that queueing a pool never allocates
+class BlockPoolQueue
+{
+	MemoryBlockPool* head = nullptr;
+	MemoryBlockPool* tail = nullptr;
+public:
+	bool empty() const { return head == nullptr; }
+	MemoryBlockPool* front() const { return head; }
+	void pushBack(MemoryBlockPool* pool);
+	void popFront();
+	void erase(MemoryBlockPool* pool);
+};
+
 class MemoryBlockPool : public MemoryPool
 {
 	//struct Entry
@@ -36,48 +62,155 @@ class MemoryBlockPool : public MemoryPool
 	//};
 public:
 	void* const baseAddress;
-	std::atomic<int> freeSpace;
-	std::list<MemoryBlockPool*>::iterator it;
+	// links of the BlockPoolQueue, valid while isOnQueue
+	MemoryBlockPool* prevOnQueue;
+	MemoryBlockPool* nextOnQueue;
 	bool isOnQueue;
 	const int poolSize;
 	const int blockSize;
+	// index of the size class, so that frees need not look it up
+	const int classIndex;
+	// occupancy in a bitmap rather than in free lists
+	const bool usesBitmap;
+	// the queue the pool was created for, of its class and NUMA node, to which it returns once it has free blocks
+	BlockPoolQueue* const freePools;
 private:
 	//const int entrySize;
 	const int numBlock;
-	PSLIST_HEADER freeHead;
-	const size_t slistAddress;
 	const size_t dataAddress;
+	const uint64_t reciprocal;
+	std::atomic<uint64_t>* const bitmap;
+	// free blocks, linked through their first bytes; kept here rather than in the pool so that
+	// the contended head never shares a cache line with data
+	AtomicStack freeHead;
+	// blocks handed back in bulk by other threads, chained the same way and drained once freeHead runs dry
+	// the free space is not kept apart: the lists count their blocks in the CAS that links them
+	AtomicStack remoteFreeHead;
+	// blocks from bumpIndex on have never been handed out and are in no list,
+	// so a new pool neither links nor touches its blocks up front
+	std::atomic<int> bumpIndex;
 public:
-	MemoryBlockPool(CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, std::list<MemoryBlockPool*>& freePools);
+	// useBitmap needs the pool to hold at most BITMAP_BITS blocks after the bitmap, and the pool to be 32-byte aligned
+	MemoryBlockPool(CustomMemoryManager* manager, void* baseAddress, int poolSize, int blockSize, BlockPoolQueue& freePools, bool useBitmap = false);
 	void* allocate(size_t size) override final;
+	// up to count blocks taken with a single CAS, fewer if the pool runs dry
+	int allocateBatch(void** blocks, int count);
 	size_t free(void* ptr) override final;
+	// frees count blocks with a single CAS; returns the free space after
+	size_t freeRemote(void** blocks, int count);
+	// start of the block holding ptr, which may point anywhere within it
+	void* blockStart(void* ptr) const;
+	// bytes from ptr to the end of its block
+	size_t usableSize(void* ptr) const;
+	// counted from the bitmap or the lists, as of some recent moment
+	size_t currentFreeSpace() const;
+private:
+	size_t blockIndex(void* ptr) const;
+	// clears the bits of up to count free blocks, with one atomic per bitmap word
+	int takeFromBitmap(void** blocks, int count);
+	// sets the bits of the blocks, with one atomic per run of blocks in the same word; returns the free space after
+	size_t returnToBitmap(void** blocks, int count);
+	// up to count never used blocks
+	int allocateFresh(void** blocks, int count);
+	int freshBlocks() const;
+	int drainRemote(void** blocks, int count);
 };
 
+namespace MemoryListPoolConstants
+{
+	constexpr size_t ALIGNMENT = 16;
+	// each power-of-two size range is split linearly into SL_COUNT bins
+	constexpr int SL_LOG2 = 4;
+	constexpr int SL_COUNT = 1 << SL_LOG2;
+	// sizes below SMALL_SIZE share the first range, one bin per ALIGNMENT bytes
+	constexpr int FL_SHIFT = SL_LOG2 + 4;
+	constexpr size_t SMALL_SIZE = 1 << FL_SHIFT;
+	constexpr int FL_COUNT = 32;
+	// free blocks of the requested size checked for a fit before splitting a larger one
+	constexpr int ALIGNED_PROBE_COUNT = 8;
+	// boundary tag in front of every block; allocations return the address right after it
+	constexpr size_t HEADER_SIZE = 16;
+	// a free block also holds its free list links
+	constexpr size_t MIN_BLOCK_SIZE = HEADER_SIZE + 16;
+	// free blocks from this size on are timestamped, and purged but for their front once unused long enough
+	constexpr size_t MIN_PURGEABLE_SIZE = 2 * (1 << 20);
+}
+
 class MemoryListPool : public MemoryPool
 {
-	struct Entry
+public:
+	// the front of a block's header, which is all a block in use needs
+	struct BoundaryTag
 	{
-		void* address;
-		size_t size;
-		bool isOnFreeList;
-		std::list<std::list<Entry>::iterator>::iterator freeListIt;
-		Entry(void* address, size_t size, bool isOnFreeList) :
-			address(address), size(size), isOnFreeList(isOnFreeList) {}
+		size_t prevSize;
+		size_t sizeAndFlags;
+	};
+private:
+	// blocks tile the pool; sizes include the header and are multiples of ALIGNMENT
+	// the header of a page handed out by allocatePage is kept out of band, so that the page is wholly usable
+	struct BlockHeader
+	{
+		// size of the previous block, valid only while that block is free
+		size_t prevSize;
+		// size | FREE | PREV_FREE
+		size_t sizeAndFlags;
+		// free blocks only, stored in the payload
+		BlockHeader* nextFree;
+		BlockHeader* prevFree;
 	};
 public:
+	Platform::PageBacking backing;
+	// NUMA node the pages are placed on, -1 for any
+	const int node;
+	// huge arena owning the pool and the next pool of that arena, set by the manager
+	int arena = 0;
+	MemoryListPool* next = nullptr;
 	void* const baseAddress;
 	const size_t poolSize;
 	size_t freeSpace;
+	// bytes of free pages returned to the OS; the rest of the pool counts as committed
+	size_t purgedSpace = 0;
 private:
-	std::list<Entry> entryList;
-	std::list<std::list<Entry>::iterator> freeList;
-	std::map<void*, std::list<Entry>::iterator> usedMap;
-	//Entry* entryListHead;
-	//Entry* freeListHead;
+	// segregated free lists (TLSF): a bitmap of non-empty power-of-two ranges,
+	// and per range a bitmap of non-empty bins
+	uint32_t firstLevelMap;
+	std::array<uint32_t, MemoryListPoolConstants::FL_COUNT> secondLevelMaps;
+	std::array<BlockHeader*, MemoryListPoolConstants::FL_COUNT * MemoryListPoolConstants::SL_COUNT> freeLists;
 public:
-	MemoryListPool(CustomMemoryManager* manager, size_t poolSize);
+	MemoryListPool(CustomMemoryManager* manager, size_t poolSize, bool useHugePages = false, int node = -1);
 	~MemoryListPool();
 	void* allocate(size_t size) override final;
 	size_t free(void* ptr) override final;
+	// the block, header included, is size bytes aligned by size; size - HEADER_SIZE bytes are usable
 	void* allocateAligned(size_t size);
+	// a whole PAGE_SIZE page, aligned by its size, whose boundary tag is moved to tag; from there on
+	// and until freePage, CustomMemoryManager::wholePageTag must find the tag through the page map
+	void* allocatePage(BoundaryTag& tag);
+	// once wholePageTag no longer finds the tag, which goes back in band; returns the free space after
+	size_t freePage(void* page, const BoundaryTag& tag);
+	// size usable bytes at offset bytes past a multiple of alignment, a power of two
+	void* allocate(size_t size, size_t alignment, size_t offset = 0);
+	// grows or shrinks the block at ptr in place, into the free block after it; false if there is no room
+	bool resize(void* ptr, size_t size);
+	// bytes usable at ptr, returned by allocate
+	size_t usableSize(void* ptr) const;
+	// returns the whole pages of free blocks unused for decayMs to the OS, and the bytes purged
+	size_t purge(uint64_t decayMs);
+private:
+	// the header of the block at address, out of band for a page from allocatePage
+	BlockHeader* headerAt(size_t address) const;
+	// a block of size bytes starting offset bytes before a multiple of alignment
+	void* allocateAt(size_t size, size_t alignment, size_t offset);
+	static int binIndex(size_t size);
+	static size_t roundUpToBin(size_t size);
+	int findBin(size_t size);
+	void insertFree(BlockHeader* block);
+	void removeFree(BlockHeader* block);
+	// marks the block free in its own header and in the header of the next block
+	void markFree(BlockHeader* block, size_t size);
+	void* take(BlockHeader* block, size_t address, size_t size);
+	// blocks of at least MIN_PURGEABLE_SIZE keep the time they were freed after the header
+	static uint64_t* freeSince(BlockHeader* block);
+	// the system pages of the block past its front, or the 2 MiB pages of a hugetlb pool
+	void purgeableRange(BlockHeader* block, size_t& from, size_t& to) const;
 };
\ No newline at end of file
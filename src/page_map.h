@@ -0,0 +1,69 @@
+#pragma once
+
+// two-level radix tree from 2 MiB page number to Page
+// reads are lock-free; a leaf is installed before any page in its range is published and is never removed
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+class Page;
+
+namespace PageMapConstants
+{
+	constexpr int ADDRESS_BITS = 48;
+	constexpr int PAGE_BITS = 21;
+	constexpr int LEAF_BITS = 14;
+	constexpr int ROOT_BITS = ADDRESS_BITS - PAGE_BITS - LEAF_BITS;
+	constexpr size_t LEAF_SIZE = 1ULL << LEAF_BITS;
+	constexpr size_t ROOT_SIZE = 1ULL << ROOT_BITS;
+}
+
+class PageMap
+{
+public:
+	struct Leaf
+	{
+		std::array<std::atomic<Page*>, PageMapConstants::LEAF_SIZE> pages{};
+	};
+private:
+	std::array<std::atomic<Leaf*>, PageMapConstants::ROOT_SIZE> root{};
+public:
+	Page* get(size_t pageNum) const
+	{
+		using namespace PageMapConstants;
+		if ((pageNum >> LEAF_BITS) >= ROOT_SIZE)
+			return nullptr;
+		Leaf* leaf = root[pageNum >> LEAF_BITS].load(std::memory_order_acquire);
+		if (leaf == nullptr)
+			return nullptr;
+		return leaf->pages[pageNum & (LEAF_SIZE - 1)].load(std::memory_order_acquire);
+	}
+	Page* get(void* ptr) const { return get((size_t)ptr >> PageMapConstants::PAGE_BITS); }
+
+	// the leaf covering pageNum must have been reserved
+	void set(size_t pageNum, Page* page)
+	{
+		using namespace PageMapConstants;
+		Leaf* leaf = root[pageNum >> LEAF_BITS].load(std::memory_order_acquire);
+		leaf->pages[pageNum & (LEAF_SIZE - 1)].store(page, std::memory_order_release);
+	}
+
+	// installs the leaves covering [fromPageNum, toPageNum]
+	// allocateLeaf and freeLeaf hand out and take back raw storage of sizeof(Leaf) bytes
+	template <typename Allocate, typename Free>
+	void reserve(size_t fromPageNum, size_t toPageNum, Allocate allocateLeaf, Free freeLeaf)
+	{
+		using namespace PageMapConstants;
+		for (size_t index = fromPageNum >> LEAF_BITS; index <= (toPageNum >> LEAF_BITS); index++)
+		{
+			if (root[index].load(std::memory_order_acquire) != nullptr)
+				continue;
+			Leaf* leaf = new (allocateLeaf()) Leaf();
+			Leaf* expected = nullptr;
+			if (!root[index].compare_exchange_strong(expected, leaf, std::memory_order_acq_rel))
+				freeLeaf(leaf);
+		}
+	}
+};
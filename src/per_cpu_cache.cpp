@@ -0,0 +1,77 @@
+#include "per_cpu_cache.h"
+
+#include "memory_manager.h"
+
+#include <algorithm>
+#ifdef MEMORY_MANAGER_HAS_RSEQ
+#include <unistd.h>
+#endif
+
+using namespace CustomMemoryManagerConstants;
+using namespace PerCpuCacheConstants;
+
+PerCpuCache::PerCpuCache(CustomMemoryManager* manager, bool isEnabled) :
+	manager(manager)
+{
+#ifdef MEMORY_MANAGER_HAS_RSEQ
+	// glibc registers every thread or none
+	if (!isEnabled || __rseq_size == 0)
+		return;
+	// the kernel numbers CPUs below the count of possible ones
+	cpuCount = std::max(1, (int)sysconf(_SC_NPROCESSORS_CONF));
+	size_t offset = CLASS_COUNT * sizeof(SizeClassCounters) + sizeof(uint64_t);
+	for (int i = 0; i < CLASS_COUNT; i++)
+	{
+		capacities[i] = ThreadCache::magazineCapacity(i < SMALL_CLASS_COUNT ? SMALL_BLOCK_SIZES[i] : LARGE_BLOCK_SIZES[i - SMALL_CLASS_COUNT]);
+		magazineOffsets[i] = (uint32_t)offset;
+		if (capacities[i] > 0)
+			offset += sizeof(uint64_t) + capacities[i] * sizeof(void*);
+	}
+	cpuStride = (offset + CPU_ALIGNMENT - 1) / CPU_ALIGNMENT * CPU_ALIGNMENT;
+	regionSize = (cpuCount * cpuStride + Platform::SYSTEM_PAGE_SIZE - 1) / Platform::SYSTEM_PAGE_SIZE * Platform::SYSTEM_PAGE_SIZE;
+	region = (char*)Platform::reservePages(regionSize, Platform::SYSTEM_PAGE_SIZE);
+#else
+	(void)isEnabled;
+#endif
+}
+
+PerCpuCache::~PerCpuCache()
+{
+	// the blocks left in the magazines go with the pools they belong to
+	if (region != nullptr)
+		Platform::releasePages(region, regionSize);
+}
+
+void* PerCpuCache::refill(bool isSmallPool, int index)
+{
+	const int classIndex = classIndexOf(isSmallPool, index);
+	void* blocks[ThreadCacheConstants::MAX_MAGAZINE_SIZE];
+	// half a magazine, so that both allocations and frees have room
+	const int count = manager->allocateBlocks(isSmallPool, index, blocks, std::max(1, capacities[classIndex] / 2));
+	this->count(classIndex, offsetof(SizeClassCounters, poolAllocations), count);
+	// onto the magazine of whichever CPU the thread is on by now; what does not fit goes back
+	int kept = 1;
+	while (kept < count && push(classIndex, blocks[kept]))
+		kept++;
+	if (kept < count)
+	{
+		manager->freeBlocks(isSmallPool, index, blocks + kept, count - kept);
+		this->count(classIndex, offsetof(SizeClassCounters, poolFrees), count - kept);
+	}
+	return blocks[0];
+}
+
+void PerCpuCache::flush(bool isSmallPool, int index, void* ptr)
+{
+	const int classIndex = classIndexOf(isSmallPool, index);
+	void* blocks[ThreadCacheConstants::MAX_MAGAZINE_SIZE + 1];
+	int count = 0;
+	const int half = std::max(1, capacities[classIndex] / 2);
+	while (count < half && (blocks[count] = pop(classIndex)) != nullptr)
+		count++;
+	// the thread may have moved to a CPU with room in the meantime
+	if (!push(classIndex, ptr))
+		blocks[count++] = ptr;
+	manager->freeBlocks(isSmallPool, index, blocks, count);
+	this->count(classIndex, offsetof(SizeClassCounters, poolFrees), count);
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+// per-CPU magazines in front of the block pools, an alternative to the thread caches
+// with many mostly idle threads, whose magazines would each hold blocks of their own
+// a magazine is popped and pushed, and the counters of its CPU are added to, in restartable sequences (rseq),
+// which the kernel restarts when the thread is preempted or migrated within them, so that none takes an atomic instruction
+// needs Linux on x86-64 and a glibc that registers rseq for its threads; elsewhere no thread is ever active
+
+#include "size_classes.h"
+#include "thread_cache.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEMORY_MANAGER_HAS_RSEQ
+#endif
+#endif
+
+class CustomMemoryManager;
+
+namespace PerCpuCacheConstants
+{
+	// precedes the abort handler of each restartable sequence; the kernel checks it before jumping there
+	constexpr uint32_t RSEQ_SIGNATURE = 0x53053053;
+	constexpr int CLASS_COUNT = CustomMemoryManagerConstants::SMALL_CLASS_COUNT + CustomMemoryManagerConstants::LARGE_CLASS_COUNT;
+	// the parts of the CPUs do not share cache lines
+	constexpr size_t CPU_ALIGNMENT = 64;
+}
+
+class PerCpuCache
+{
+	CustomMemoryManager* const manager;
+	// the part of each CPU, cpuStride bytes apart: the counters of the classes and the count of cross-node frees,
+	// then the magazine of each cached class, its count followed by its blocks; fresh pages read as zero, so a CPU's part is committed once the CPU is used
+	char* region = nullptr;
+	size_t regionSize = 0;
+	size_t cpuStride = 0;
+	std::array<uint32_t, PerCpuCacheConstants::CLASS_COUNT> magazineOffsets{};
+	std::array<int, PerCpuCacheConstants::CLASS_COUNT> capacities{};
+	int cpuCount = 0;
+public:
+	// without rseq, or not enabled, the cache takes no memory and isActive() is false
+	PerCpuCache(CustomMemoryManager* manager, bool isEnabled);
+	~PerCpuCache();
+
+	// true if the calling thread's operations go through the cache
+	bool isActive() const
+	{
+#ifdef MEMORY_MANAGER_HAS_RSEQ
+		return region != nullptr && (int32_t)rseqArea()->cpu_id >= 0;
+#else
+		return false;
+#endif
+	}
+	// nullptr if the class is not cached; isActive() must hold
+	void* allocate(bool isSmallPool, int index)
+	{
+		const int classIndex = classIndexOf(isSmallPool, index);
+		count(classIndex, offsetof(SizeClassCounters, allocations), 1);
+		if (capacities[classIndex] == 0)
+		{
+			count(classIndex, offsetof(SizeClassCounters, poolAllocations), 1);
+			return nullptr;
+		}
+		void* ptr = pop(classIndex);
+		return ptr != nullptr ? ptr : refill(isSmallPool, index);
+	}
+	// false if the class is not cached; isActive() must hold
+	bool free(void* ptr, bool isSmallPool, int index)
+	{
+		const int classIndex = classIndexOf(isSmallPool, index);
+		count(classIndex, offsetof(SizeClassCounters, frees), 1);
+		if (capacities[classIndex] == 0)
+		{
+			count(classIndex, offsetof(SizeClassCounters, poolFrees), 1);
+			return false;
+		}
+		if (!push(classIndex, ptr))
+			flush(isSmallPool, index, ptr);
+		return true;
+	}
+	int cpus() const { return region != nullptr ? cpuCount : 0; }
+	const SizeClassCounters& counters(int cpu, bool isSmallPool, int index) const
+	{
+		return ((const SizeClassCounters*)(region + cpu * cpuStride))[classIndexOf(isSmallPool, index)];
+	}
+	// isActive() must hold
+	void countCrossNodeFrees(uint64_t count)
+	{
+		add(PerCpuCacheConstants::CLASS_COUNT * sizeof(SizeClassCounters), count);
+	}
+	uint64_t crossNodeFrees(int cpu) const
+	{
+		return ((const std::atomic<uint64_t>*)(region + cpu * cpuStride + PerCpuCacheConstants::CLASS_COUNT * sizeof(SizeClassCounters)))->load(std::memory_order_relaxed);
+	}
+
+private:
+	static int classIndexOf(bool isSmallPool, int index)
+	{
+		return isSmallPool ? index : CustomMemoryManagerConstants::SMALL_CLASS_COUNT + index;
+	}
+	// adds to the counter at field within the class's counters of the current CPU; any CPU's would do for the sums
+	void count(int classIndex, size_t field, uint64_t value)
+	{
+		add(classIndex * sizeof(SizeClassCounters) + field, value);
+	}
+	// takes half a magazine from the pools, returns one block and keeps the rest
+	void* refill(bool isSmallPool, int index);
+	// gives half of the full magazine back to the pools and keeps ptr
+	void flush(bool isSmallPool, int index, void* ptr);
+
+#ifdef MEMORY_MANAGER_HAS_RSEQ
+	static struct rseq* rseqArea()
+	{
+		return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+	}
+
+	// the top block of the class's magazine of the current CPU, nullptr if it is empty
+	void* pop(int classIndex)
+	{
+		char* const base = region + magazineOffsets[classIndex];
+		void* ret;
+		uint64_t magazine, count;
+		// 1: to 2: is the sequence, whose last instruction commits; 4: is the abort handler, which starts over
+		asm volatile(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0, 0\n\t"
+			".quad 1f, 2f - 1f, 4f\n\t"
+			".popsection\n\t"
+			"0:\n\t"
+			"leaq 3b(%%rip), %[magazine]\n\t"
+			"movq %[magazine], %c[csOffset](%[rseq])\n\t"
+			"1:\n\t"
+			"movl %c[cpuOffset](%[rseq]), %k[magazine]\n\t"
+			"imulq %[stride], %[magazine]\n\t"
+			"addq %[base], %[magazine]\n\t"
+			"movq (%[magazine]), %[count]\n\t"
+			"testq %[count], %[count]\n\t"
+			"jz 5f\n\t"
+			"movq (%[magazine], %[count], 8), %[ret]\n\t"
+			"decq %[count]\n\t"
+			"movq %[count], (%[magazine])\n\t"
+			"2:\n\t"
+			"jmp 6f\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".byte 0x0f, 0xb9, 0x3d\n\t"
+			".long %c[signature]\n\t"
+			"4:\n\t"
+			"jmp 0b\n\t"
+			".popsection\n\t"
+			"5:\n\t"
+			"xorl %k[ret], %k[ret]\n\t"
+			"6:\n\t"
+			: [ret] "=&r"(ret), [magazine] "=&r"(magazine), [count] "=&r"(count)
+			: [rseq] "r"(rseqArea()), [base] "r"(base), [stride] "r"(cpuStride),
+			[csOffset] "i"(offsetof(struct rseq, rseq_cs)), [cpuOffset] "i"(offsetof(struct rseq, cpu_id)),
+			[signature] "i"(PerCpuCacheConstants::RSEQ_SIGNATURE)
+			: "memory", "cc");
+		return ret;
+	}
+
+	// the add, a plain one, is the commit: a thread preempted before it starts over on its new CPU
+	void add(size_t offset, uint64_t value)
+	{
+		char* const base = region + offset;
+		uint64_t counter;
+		asm volatile(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0, 0\n\t"
+			".quad 1f, 2f - 1f, 4f\n\t"
+			".popsection\n\t"
+			"0:\n\t"
+			"leaq 3b(%%rip), %[counter]\n\t"
+			"movq %[counter], %c[csOffset](%[rseq])\n\t"
+			"1:\n\t"
+			"movl %c[cpuOffset](%[rseq]), %k[counter]\n\t"
+			"imulq %[stride], %[counter]\n\t"
+			"addq %[value], (%[base], %[counter])\n\t"
+			"2:\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".byte 0x0f, 0xb9, 0x3d\n\t"
+			".long %c[signature]\n\t"
+			"4:\n\t"
+			"jmp 0b\n\t"
+			".popsection\n\t"
+			: [counter] "=&r"(counter)
+			: [rseq] "r"(rseqArea()), [base] "r"(base), [stride] "r"(cpuStride), [value] "r"(value),
+			[csOffset] "i"(offsetof(struct rseq, rseq_cs)), [cpuOffset] "i"(offsetof(struct rseq, cpu_id)),
+			[signature] "i"(PerCpuCacheConstants::RSEQ_SIGNATURE)
+			: "memory", "cc");
+	}
+
+	// false if the class's magazine of the current CPU is full
+	bool push(int classIndex, void* ptr)
+	{
+		char* const base = region + magazineOffsets[classIndex];
+		const uint64_t capacity = capacities[classIndex];
+		int ret;
+		uint64_t magazine, count;
+		// the block is written above the top before the commit, where a restart leaves it unseen
+		asm volatile(
+			".pushsection __rseq_cs, \"aw\"\n\t"
+			".balign 32\n\t"
+			"3:\n\t"
+			".long 0, 0\n\t"
+			".quad 1f, 2f - 1f, 4f\n\t"
+			".popsection\n\t"
+			"0:\n\t"
+			"leaq 3b(%%rip), %[magazine]\n\t"
+			"movq %[magazine], %c[csOffset](%[rseq])\n\t"
+			"1:\n\t"
+			"movl %c[cpuOffset](%[rseq]), %k[magazine]\n\t"
+			"imulq %[stride], %[magazine]\n\t"
+			"addq %[base], %[magazine]\n\t"
+			"movq (%[magazine]), %[count]\n\t"
+			"cmpq %[capacity], %[count]\n\t"
+			"jae 5f\n\t"
+			"movq %[ptr], 8(%[magazine], %[count], 8)\n\t"
+			"incq %[count]\n\t"
+			"movq %[count], (%[magazine])\n\t"
+			"2:\n\t"
+			"movl $1, %[ret]\n\t"
+			"jmp 6f\n\t"
+			".pushsection __rseq_failure, \"ax\"\n\t"
+			".byte 0x0f, 0xb9, 0x3d\n\t"
+			".long %c[signature]\n\t"
+			"4:\n\t"
+			"jmp 0b\n\t"
+			".popsection\n\t"
+			"5:\n\t"
+			"xorl %[ret], %[ret]\n\t"
+			"6:\n\t"
+			: [ret] "=&r"(ret), [magazine] "=&r"(magazine), [count] "=&r"(count)
+			: [rseq] "r"(rseqArea()), [base] "r"(base), [stride] "r"(cpuStride), [capacity] "r"(capacity), [ptr] "r"(ptr),
+			[csOffset] "i"(offsetof(struct rseq, rseq_cs)), [cpuOffset] "i"(offsetof(struct rseq, cpu_id)),
+			[signature] "i"(PerCpuCacheConstants::RSEQ_SIGNATURE)
+			: "memory", "cc");
+		return ret != 0;
+	}
+#else
+	void* pop(int classIndex) { return nullptr; }
+	void add(size_t offset, uint64_t value) {}
+	bool push(int classIndex, void* ptr) { return false; }
+#endif
+};
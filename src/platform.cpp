@@ -0,0 +1,297 @@
+#include "platform.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <execinfo.h>
+#include <cstdio>
+
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+#endif
+
+#ifdef _WIN32
+
+void* Platform::reservePages(size_t size, size_t alignment, bool hugePages, PageBacking* backing)
+{
+	// large pages need SeLockMemoryPrivilege; not supported here
+	void* ptr = _aligned_malloc(size, alignment);
+	assert(ptr != nullptr);
+	if (backing != nullptr)
+		*backing = PageBacking::NORMAL;
+	return ptr;
+}
+
+void Platform::releasePages(void* ptr, size_t size)
+{
+	_aligned_free(ptr);
+}
+
+void Platform::purgePages(void* ptr, size_t size)
+{
+	// heap memory from _aligned_malloc cannot be decommitted piecewise; purging is a no-op
+}
+
+void Platform::protectPages(void* ptr, size_t size, bool isAccessible)
+{
+	DWORD previous;
+	[[maybe_unused]] BOOL ret = VirtualProtect(ptr, size, isAccessible ? PAGE_READWRITE : PAGE_NOACCESS, &previous);
+	assert(ret);
+}
+
+void Platform::movePages(void* from, void* to, size_t size)
+{
+	memcpy(to, from, size);
+}
+
+size_t Platform::transparentHugeBytes(const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+	return 0;
+}
+
+size_t Platform::residentBytes()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.WorkingSetSize;
+}
+
+int Platform::captureStack(void** frames, int maxDepth, int skip)
+{
+	return CaptureStackBackTrace(skip + 1, maxDepth, frames, nullptr);
+}
+
+std::string Platform::mappedLibraries()
+{
+	return std::string();
+}
+
+int Platform::numaNodeCount()
+{
+	ULONG highest = 0;
+	return GetNumaHighestNodeNumber(&highest) ? (int)highest + 1 : 1;
+}
+
+int Platform::currentNumaNode()
+{
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+	USHORT node = 0;
+	return GetNumaProcessorNodeEx(&processor, &node) ? node : 0;
+}
+
+void Platform::bindPages(void* ptr, size_t size, int node)
+{
+	// heap memory from _aligned_malloc cannot be placed; VirtualAllocExNuma would need reservePages to use it
+}
+
+int Platform::pageNumaNode(void* ptr)
+{
+	PSAPI_WORKING_SET_EX_INFORMATION info;
+	info.VirtualAddress = ptr;
+	if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid)
+		return -1;
+	return info.VirtualAttributes.Node;
+}
+
+#else
+
+namespace
+{
+	constexpr size_t HUGE_PAGE_SIZE = 2 * (1 << 20);
+}
+
+void* Platform::reservePages(size_t size, size_t alignment, bool hugePages, PageBacking* backing)
+{
+	if (backing != nullptr)
+		*backing = PageBacking::NORMAL;
+	if (hugePages && size % HUGE_PAGE_SIZE == 0 && HUGE_PAGE_SIZE % alignment == 0)
+	{
+		// hugetlb mappings are always aligned to the huge page size
+		void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+		{
+			if (backing != nullptr)
+				*backing = PageBacking::HUGETLB;
+			return ptr;
+		}
+	}
+
+	// over-reserve by the alignment and trim both ends
+	size_t reserved = size + alignment;
+	void* ptr = mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(ptr != MAP_FAILED);
+	size_t from = (size_t)ptr;
+	size_t aligned = (from + alignment - 1) / alignment * alignment;
+	if (aligned > from)
+		munmap(ptr, aligned - from);
+	size_t tail = from + reserved - (aligned + size);
+	if (tail > 0)
+		munmap((void*)(aligned + size), tail);
+
+	if (hugePages && madvise((void*)aligned, size, MADV_HUGEPAGE) == 0 && backing != nullptr)
+		*backing = PageBacking::TRANSPARENT_HUGE;
+	return (void*)aligned;
+}
+
+void Platform::releasePages(void* ptr, size_t size)
+{
+	munmap(ptr, size);
+}
+
+void Platform::purgePages(void* ptr, size_t size)
+{
+	// MADV_DONTNEED rather than MADV_FREE so that the resident size drops right away
+	madvise(ptr, size, MADV_DONTNEED);
+}
+
+void Platform::protectPages(void* ptr, size_t size, bool isAccessible)
+{
+	[[maybe_unused]] int ret = mprotect(ptr, size, isAccessible ? PROT_READ | PROT_WRITE : PROT_NONE);
+	assert(ret == 0);
+}
+
+void Platform::movePages(void* from, void* to, size_t size)
+{
+	assert((size_t)from % SYSTEM_PAGE_SIZE == (size_t)to % SYSTEM_PAGE_SIZE);
+	size_t first = ((size_t)from + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE * SYSTEM_PAGE_SIZE;
+	size_t last = ((size_t)from + size) / SYSTEM_PAGE_SIZE * SYSTEM_PAGE_SIZE;
+	if (last <= first)
+	{
+		memcpy(to, from, size);
+		return;
+	}
+	size_t delta = (size_t)to - (size_t)from;
+	// the partial pages at both ends are shared with neighbouring blocks
+	memcpy(to, from, first - (size_t)from);
+	memcpy((void*)(last + delta), (void*)last, (size_t)from + size - last);
+	// MREMAP_DONTUNMAP leaves the source mapped, to read as zero
+	void* ptr = mremap((void*)first, last - first, last - first, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, (void*)(first + delta));
+	if (ptr != MAP_FAILED)
+		return;
+	// before Linux 5.7, the source is unmapped and mapped afresh, as it still belongs to its pool
+	ptr = mremap((void*)first, last - first, last - first, MREMAP_MAYMOVE | MREMAP_FIXED, (void*)(first + delta));
+	if (ptr == MAP_FAILED)
+	{
+		memcpy((void*)(first + delta), (void*)first, last - first);
+		return;
+	}
+	ptr = mmap((void*)first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	assert(ptr != MAP_FAILED);
+}
+
+size_t Platform::transparentHugeBytes(const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+	FILE* file = fopen("/proc/self/smaps", "r");
+	if (file == nullptr)
+		return 0;
+	// adjacent pools may share one mapping; each mapping is counted once
+	size_t ret = 0;
+	bool overlaps = false;
+	char line[512];
+	while (fgets(line, sizeof(line), file) != nullptr)
+	{
+		size_t from, to, kiB;
+		if (sscanf(line, "%zx-%zx ", &from, &to) == 2)
+		{
+			overlaps = false;
+			for (auto& range : ranges)
+				overlaps |= from < range.second && range.first < to;
+		}
+		else if (overlaps && sscanf(line, "AnonHugePages: %zu kB", &kiB) == 1)
+			ret += kiB << 10;
+	}
+	fclose(file);
+	return ret;
+}
+
+size_t Platform::residentBytes()
+{
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file == nullptr)
+		return 0;
+	size_t pages = 0, residentPages = 0;
+	if (fscanf(file, "%zu %zu", &pages, &residentPages) != 2)
+		residentPages = 0;
+	fclose(file);
+	return residentPages * sysconf(_SC_PAGESIZE);
+}
+
+int Platform::captureStack(void** frames, int maxDepth, int skip)
+{
+	constexpr int MAX_FRAMES = 128;
+	void* all[MAX_FRAMES];
+	int depth = backtrace(all, std::min(MAX_FRAMES, maxDepth + skip + 1));
+	int ret = std::max(0, depth - skip - 1);
+	memcpy(frames, all + skip + 1, ret * sizeof(void*));
+	return ret;
+}
+
+std::string Platform::mappedLibraries()
+{
+	std::string ret;
+	FILE* file = fopen("/proc/self/maps", "r");
+	if (file == nullptr)
+		return ret;
+	char buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		ret.append(buffer, read);
+	fclose(file);
+	return ret;
+}
+
+int Platform::numaNodeCount()
+{
+	// a list of ranges such as "0-1,3"; the count is one past the highest node
+	FILE* file = fopen("/sys/devices/system/node/online", "r");
+	if (file == nullptr)
+		return 1;
+	int highest = 0, node = 0;
+	char separator = 0;
+	while (fscanf(file, "%d%c", &node, &separator) >= 1)
+		highest = std::max(highest, node);
+	fclose(file);
+	return highest + 1;
+}
+
+int Platform::currentNumaNode()
+{
+	unsigned cpu = 0, node = 0;
+	return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? (int)node : 0;
+}
+
+void Platform::bindPages(void* ptr, size_t size, int node)
+{
+	// preferred rather than bound, so that a full node spills over instead of failing the page faults
+	constexpr int MPOL_PREFERRED = 1;
+	constexpr int MASK_WORDS = 16;
+	constexpr int MASK_BITS = MASK_WORDS * 64;
+	if (node < 0 || node >= MASK_BITS)
+		return;
+	uint64_t mask[MASK_WORDS] = {};
+	mask[node / 64] = (uint64_t)1 << (node % 64);
+	// the kernel reads one bit less than maxnode; failures, as under seccomp, leave the default placement
+	syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask, MASK_BITS + 1, 0);
+}
+
+int Platform::pageNumaNode(void* ptr)
+{
+	void* page = (void*)((size_t)ptr / SYSTEM_PAGE_SIZE * SYSTEM_PAGE_SIZE);
+	int status = -1;
+	if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0)
+		return -1;
+	return status >= 0 ? status : -1;
+}
+
+#endif
@@ -0,0 +1,260 @@
+#pragma once
+
+// platform layer
+// lock-free intrusive stack used by the block pools and the page provider used by the list pools
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Platform
+{
+	constexpr size_t MEMORY_ALLOCATION_ALIGNMENT = 16;
+	// granularity of movePages
+	constexpr size_t SYSTEM_PAGE_SIZE = 4 * (1 << 10);
+
+	enum class PageBacking {
+		NORMAL, HUGETLB, TRANSPARENT_HUGE,
+	};
+
+	// reserves size bytes of read-write memory aligned to alignment
+	// with hugePages, tries MAP_HUGETLB first and falls back to madvise(MADV_HUGEPAGE)
+	void* reservePages(size_t size, size_t alignment, bool hugePages = false, PageBacking* backing = nullptr);
+	void releasePages(void* ptr, size_t size);
+	// drops the contents of reserved pages so that the OS can reclaim them; they read as zero when touched again
+	void purgePages(void* ptr, size_t size);
+	// makes reserved pages inaccessible, or read-write again; ptr and size are multiples of SYSTEM_PAGE_SIZE
+	void protectPages(void* ptr, size_t size, bool isAccessible);
+	// moves size bytes of reserved memory to another reserved range at the same offset within a system page
+	// whole pages are remapped rather than copied; the source keeps its pages, with undefined contents
+	void movePages(void* from, void* to, size_t size);
+	// bytes of the given [from, to) ranges currently backed by transparent huge pages
+	size_t transparentHugeBytes(const std::vector<std::pair<size_t, size_t>>& ranges);
+	// resident set size of the process
+	size_t residentBytes();
+	// return addresses of the calling thread's stack, innermost first, leaving out the skip innermost frames
+	// besides captureStack's own; returns the number captured
+	int captureStack(void** frames, int maxDepth, int skip);
+	// the memory map of the process in the format of /proc/self/maps, for symbolizing captured stacks
+	std::string mappedLibraries();
+	// NUMA nodes of the machine, numbered below the count; 1 if it has no NUMA or the nodes are unknown
+	int numaNodeCount();
+	// node of the CPU the calling thread runs on
+	int currentNumaNode();
+	// places reserved pages, as they are first touched, on the node while it has memory; best effort
+	void bindPages(void* ptr, size_t size, int node);
+	// node of the resident page at ptr, -1 if it is not resident or cannot be queried
+	int pageNumaNode(void* ptr);
+
+	// value must be non-zero
+	inline int log2Floor(uint64_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+
+	// value must be non-zero
+	inline int countTrailingZeros(uint64_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, value);
+		return (int)index;
+#else
+		return __builtin_ctzll(value);
+#endif
+	}
+
+	inline int popCount(uint64_t value)
+	{
+#ifdef _MSC_VER
+		return (int)__popcnt64(value);
+#else
+		return __builtin_popcountll(value);
+#endif
+	}
+}
+
+// intrusive LIFO shared between threads, ABA-safe through a version tag
+// the head pairs the top entry with a 64-bit word updated by a double-width CAS,
+// holding the number of entries in its low COUNT_BITS and the tag above them,
+// so that the size is kept by the same CAS that links the entries
+class AtomicStack
+{
+public:
+	struct Entry
+	{
+		Entry* next;
+	};
+private:
+	static constexpr int COUNT_BITS = 32;
+	static constexpr uint64_t COUNT_MASK = ((uint64_t)1 << COUNT_BITS) - 1;
+	static constexpr uint64_t TAG_UNIT = (uint64_t)1 << COUNT_BITS;
+	struct alignas(16) Head
+	{
+		Entry* entry;
+		uint64_t tag;
+	};
+	Head head;
+
+	Head load() const
+	{
+#if defined(_M_X64) || defined(__x86_64__)
+		// a torn read only fails the following CAS, which then reloads both halves
+		Head ret;
+		ret.tag = ((volatile const Head&)head).tag;
+		ret.entry = ((volatile const Head&)head).entry;
+		return ret;
+#else
+		Head ret;
+		__atomic_load(&head, &ret, __ATOMIC_ACQUIRE);
+		return ret;
+#endif
+	}
+
+	uint64_t loadTag() const
+	{
+#if defined(_M_X64) || defined(__x86_64__)
+		return ((volatile const Head&)head).tag;
+#else
+		return __atomic_load_n(&head.tag, __ATOMIC_RELAXED);
+#endif
+	}
+
+	// on failure, expected is updated to the current head
+	bool compareExchange(Head& expected, Head desired)
+	{
+#if defined(_M_X64)
+		return _InterlockedCompareExchange128((volatile long long*)&head, (long long)desired.tag, (long long)desired.entry, (long long*)&expected);
+#elif defined(__x86_64__)
+		bool ret;
+		__asm__ __volatile__("lock cmpxchg16b %1"
+			: "=@ccz"(ret), "+m"(head), "+a"(expected.entry), "+d"(expected.tag)
+			: "b"(desired.entry), "c"(desired.tag)
+			: "memory");
+		return ret;
+#else
+		return __atomic_compare_exchange(&head, &expected, &desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+	}
+public:
+	AtomicStack() : head{ nullptr, 0 } {}
+
+	// number of entries, as of some recent moment
+	int size() const
+	{
+		return (int)(loadTag() & COUNT_MASK);
+	}
+
+	// returns the size after
+	int push(Entry* entry)
+	{
+		return pushChain(entry, entry, 1);
+	}
+
+	// pushes count entries already linked from first to last with a single CAS; returns the size after
+	int pushChain(Entry* first, Entry* last, int count)
+	{
+		Head prev = load();
+		do {
+			last->next = prev.entry;
+		} while (!compareExchange(prev, Head{ first, prev.tag + TAG_UNIT + count }));
+		return (int)((prev.tag + count) & COUNT_MASK);
+	}
+
+	// pops all entries with a single CAS; count is set to the number popped
+	Entry* popAll(int& count)
+	{
+		Head prev = load();
+		while (prev.entry != nullptr)
+		{
+			if (compareExchange(prev, Head{ nullptr, (prev.tag & ~COUNT_MASK) + TAG_UNIT }))
+			{
+				count = (int)(prev.tag & COUNT_MASK);
+				return prev.entry;
+			}
+		}
+		count = 0;
+		return nullptr;
+	}
+
+	// pops up to count entries, still linked through next, with a single CAS; count is set to the number popped
+	Entry* popChain(int& count)
+	{
+		Head prev = load();
+		while (prev.entry != nullptr)
+		{
+			// an entry popped concurrently may be in use already, its next overwritten by the user,
+			// so a link is followed only while the tag shows the stack unchanged since prev was loaded
+			Entry* last = prev.entry;
+			Entry* next = last->next;
+			int popped = 1;
+			for (; popped < count && next != nullptr; popped++)
+			{
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (loadTag() != prev.tag)
+					break;
+				last = next;
+				next = last->next;
+			}
+			if (compareExchange(prev, Head{ next, prev.tag + TAG_UNIT - popped }))
+			{
+				count = popped;
+				return prev.entry;
+			}
+		}
+		count = 0;
+		return nullptr;
+	}
+
+	Entry* pop()
+	{
+		Head prev = load();
+		while (prev.entry != nullptr)
+		{
+			// entry may be popped and reused concurrently; the tag then fails the CAS
+			Entry* next = prev.entry->next;
+			if (compareExchange(prev, Head{ next, prev.tag + TAG_UNIT - 1 }))
+				return prev.entry;
+		}
+		return nullptr;
+	}
+};
+
+// shared mutex counting the acquisitions that found it held by another thread
+// an uncontended acquisition costs the same as with std::shared_mutex
+class CountingSharedMutex : public std::shared_mutex
+{
+	std::atomic<uint64_t> contended{ 0 };
+public:
+	void lock()
+	{
+		if (!try_lock())
+		{
+			contended.fetch_add(1, std::memory_order_relaxed);
+			std::shared_mutex::lock();
+		}
+	}
+	void lock_shared()
+	{
+		if (!try_lock_shared())
+		{
+			contended.fetch_add(1, std::memory_order_relaxed);
+			std::shared_mutex::lock_shared();
+		}
+	}
+	uint64_t contentions() const { return contended.load(std::memory_order_relaxed); }
+};
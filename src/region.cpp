@@ -0,0 +1,92 @@
+#include "region.h"
+
+using namespace RegionConstants;
+
+Region::Region(CustomMemoryManager* manager) :
+	manager(manager)
+{
+}
+
+Region::~Region()
+{
+	release();
+}
+
+void* Region::allocateSlow(size_t size, size_t alignment)
+{
+	// room for the worst alignment past the header
+	if (size + alignment > CHUNK_SIZE - sizeof(Chunk))
+	{
+		Chunk* chunk = allocateChunk(sizeof(Chunk) + alignment + size);
+		chunk->next = oversized;
+		oversized = chunk;
+		return (void*)(((size_t)(chunk + 1) + alignment - 1) & ~(alignment - 1));
+	}
+	// the rest of the current chunk is left unused
+	if (current != nullptr && current->next != nullptr)
+		enter(current->next);
+	else
+	{
+		Chunk* chunk = allocateChunk(CHUNK_SIZE);
+		chunk->next = nullptr;
+		if (current != nullptr)
+			current->next = chunk;
+		else
+			first = chunk;
+		enter(chunk);
+	}
+	return allocate(size, alignment);
+}
+
+void Region::rewind(const Checkpoint& checkpoint)
+{
+	while (oversized != checkpoint.oversized)
+	{
+		Chunk* chunk = oversized;
+		oversized = chunk->next;
+		freeChunk(chunk);
+	}
+	if (checkpoint.chunk != nullptr)
+	{
+		current = checkpoint.chunk;
+		top = checkpoint.top;
+		end = (char*)current + current->size;
+	}
+	else if (first != nullptr)
+		enter(first);
+}
+
+void Region::release()
+{
+	reset();
+	while (first != nullptr)
+	{
+		Chunk* chunk = first;
+		first = chunk->next;
+		freeChunk(chunk);
+	}
+	current = nullptr;
+	top = end = nullptr;
+}
+
+Region::Chunk* Region::allocateChunk(size_t size)
+{
+	// chunks over LARGE_THRESHOLD are huge blocks, each in whole pages of the huge pools
+	Chunk* chunk = (Chunk*)manager->allocate(size);
+	chunk->size = size;
+	chunkBytes += size;
+	return chunk;
+}
+
+void Region::freeChunk(Chunk* chunk)
+{
+	chunkBytes -= chunk->size;
+	manager->free(chunk);
+}
+
+void Region::enter(Chunk* chunk)
+{
+	current = chunk;
+	top = (char*)(chunk + 1);
+	end = (char*)chunk + chunk->size;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+// bump-pointer regions over a CustomMemoryManager, for many short-lived objects that die together
+// a region takes 2 MiB chunks from the manager's huge pools and hands out their bytes in order;
+// its objects are never freed one by one, the region is rewound to a checkpoint or reset as a whole
+// a region takes no locks and is used by one thread at a time, typically the one handling a request
+
+#include "memory_manager.h"
+#include "platform.h"
+
+#include <cstddef>
+#include <memory_resource>
+
+namespace RegionConstants
+{
+	// a chunk and the list pool's header fill one 2 MiB page
+	constexpr size_t CHUNK_SIZE = CustomMemoryManagerConstants::PAGE_SIZE - MemoryListPoolConstants::HEADER_SIZE;
+}
+
+class Region
+{
+	// at the front of each chunk
+	struct Chunk
+	{
+		Chunk* next;
+		size_t size;
+	};
+	CustomMemoryManager* const manager;
+	// the chunks of CHUNK_SIZE in the order they are used; the ones past current are kept for reuse
+	Chunk* first = nullptr;
+	Chunk* current = nullptr;
+	// the free bytes of current
+	char* top = nullptr;
+	char* end = nullptr;
+	// the allocations that do not fit a chunk, each in a chunk of its own, latest first
+	Chunk* oversized = nullptr;
+	size_t chunkBytes = 0;
+public:
+	// what a region is rewound to
+	struct Checkpoint
+	{
+		Chunk* chunk;
+		char* top;
+		Chunk* oversized;
+	};
+
+	explicit Region(CustomMemoryManager* manager);
+	~Region();
+	Region(const Region&) = delete;
+	Region& operator=(const Region&) = delete;
+
+	// alignment is a power of two
+	void* allocate(size_t size, size_t alignment = Platform::MEMORY_ALLOCATION_ALIGNMENT)
+	{
+		const size_t ptr = ((size_t)top + alignment - 1) & ~(alignment - 1);
+		if (top != nullptr && ptr + size <= (size_t)end)
+		{
+			top = (char*)(ptr + size);
+			return (void*)ptr;
+		}
+		return allocateSlow(size, alignment);
+	}
+	Checkpoint checkpoint() const { return Checkpoint{ current, top, oversized }; }
+	// drops everything allocated since the checkpoint, which must have been taken since the last release
+	// the chunks stay with the region; of what was allocated, only the oversized allocations are freed one by one
+	void rewind(const Checkpoint& checkpoint);
+	// drops everything, keeping the chunks
+	void reset() { rewind(Checkpoint{ nullptr, nullptr, nullptr }); }
+	// drops everything and returns the chunks to the manager
+	void release();
+	// of the chunks held
+	size_t reportTotalSpace() const { return chunkBytes; }
+
+private:
+	// moves on to the next chunk, or takes an oversized one
+	void* allocateSlow(size_t size, size_t alignment);
+	Chunk* allocateChunk(size_t size);
+	void freeChunk(Chunk* chunk);
+	void enter(Chunk* chunk);
+};
+
+// rewinds the region to where it was when the scope was entered
+class RegionScope
+{
+	Region& region;
+	const Region::Checkpoint checkpoint;
+public:
+	explicit RegionScope(Region& region) :
+		region(region), checkpoint(region.checkpoint()) {}
+	~RegionScope() { region.rewind(checkpoint); }
+	RegionScope(const RegionScope&) = delete;
+	RegionScope& operator=(const RegionScope&) = delete;
+};
+
+// a region as a polymorphic memory resource, for the std::pmr containers; deallocation does nothing
+class RegionResource : public std::pmr::memory_resource
+{
+	Region& region;
+public:
+	explicit RegionResource(Region& region) :
+		region(region) {}
+
+private:
+	void* do_allocate(size_t bytes, size_t alignment) override
+	{
+		return region.allocate(bytes, alignment);
+	}
+	void do_deallocate(void*, size_t, size_t) override
+	{
+	}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other;
+	}
+};
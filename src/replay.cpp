@@ -0,0 +1,54 @@
+// plays an allocation trace back against the custom manager, malloc behind the MemoryManager interface, and malloc
+// record one with CustomMemoryManagerConfig::tracePath, or from any program through the malloc shim:
+//   MEMORY_MANAGER_TRACE=trace.bin LD_PRELOAD=./libmemorymanager.so program
+// build and run:
+//   g++ -std=c++17 -O2 -o replay replay.cpp benchmark.cpp hardening.cpp heap_profiler.cpp memory_manager.cpp memory_pool.cpp per_cpu_cache.cpp platform.cpp stats.cpp thread_cache.cpp trace_recorder.cpp -lpthread
+//   ./replay trace.bin [custom|basic|malloc] [repeat]
+
+#include "benchmark.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " trace [custom|basic|malloc] [repeat]" << std::endl;
+		return 2;
+	}
+	Trace trace;
+	if (!readTrace(argv[1], trace))
+	{
+		std::cerr << argv[1] << " is not an allocation trace" << std::endl;
+		return 1;
+	}
+	const char* which = argc > 2 ? argv[2] : nullptr;
+	const int repeat = argc > 3 ? std::max(1, std::atoi(argv[3])) : 1;
+
+	size_t events = 0;
+	for (auto& thread : trace.threads)
+		events += thread.size();
+	ReplayPlan plan = planReplay(trace);
+	std::cout << events << " events of " << trace.threads.size() << " threads, " << plan.blockSizes.size() << " blocks, "
+		<< plan.unmatched << " frees of blocks from before the recording" << std::endl;
+
+	for (int i = 0; i < repeat; i++)
+	{
+		if (which == nullptr || std::strcmp(which, "custom") == 0)
+		{
+			CustomMemoryManager* manager = new CustomMemoryManager();
+			printResult("custom", replayTrace(manager, plan));
+			delete manager;
+		}
+		if (which == nullptr || std::strcmp(which, "basic") == 0)
+		{
+			BasicMemoryManager manager;
+			printResult("basic", replayTrace(&manager, plan));
+		}
+		if (which == nullptr || std::strcmp(which, "malloc") == 0)
+			printResult("malloc", replayTrace(nullptr, plan));
+	}
+	return 0;
+}
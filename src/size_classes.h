@@ -0,0 +1,165 @@
+#pragma once
+
+// size classes of the block pools and their constant-time lookup
+// the lookup tables are generated at compile time from the class sizes,
+// so the spacing of the classes can be retuned by editing the sizes alone
+
+#include "platform.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace SizeClassConstants
+{
+	// log-linear bins per power of two of the large lookup
+	constexpr int SUB_BIN_BITS = 4;
+	constexpr int SUB_BIN_COUNT = 1 << SUB_BIN_BITS;
+
+	constexpr int log2Floor(size_t value)
+	{
+		int ret = 0;
+		while (value >>= 1)
+			ret++;
+		return ret;
+	}
+
+	// sizes are increasing multiples of 8
+	template <size_t N>
+	constexpr bool isValidClassTable(const std::array<size_t, N>& sizes)
+	{
+		for (size_t i = 0; i < N; i++)
+		{
+			if (sizes[i] % 8 != 0 || (i > 0 && sizes[i] <= sizes[i - 1]))
+				return false;
+		}
+		return N > 0 && N <= 256;
+	}
+}
+
+// index of the smallest class of at least size, from a table indexed by (size + 7) >> 3
+template <const auto& SIZES>
+class LinearSizeClassTable
+{
+	static_assert(SizeClassConstants::isValidClassTable(SIZES), "class sizes must be increasing multiples of 8");
+	static constexpr size_t MAX = SIZES[SIZES.size() - 1];
+	using Indices = std::array<uint8_t, MAX / 8 + 1>;
+
+	static constexpr Indices makeIndices()
+	{
+		// slot s holds the sizes up to 8 * s, all served by the first class of at least 8 * s
+		Indices ret{};
+		size_t index = 0;
+		for (size_t slot = 0; slot < ret.size(); slot++)
+		{
+			while (SIZES[index] < slot * 8)
+				index++;
+			ret[slot] = (uint8_t)index;
+		}
+		return ret;
+	}
+	static constexpr Indices INDICES = makeIndices();
+public:
+	// size must not exceed the largest class
+	static int index(size_t size) { return INDICES[(size + 7) >> 3]; }
+};
+
+// index of the smallest class of at least size, for size in (FROM, largest class], FROM a power of two
+// sizes are binned log-linearly; no bin holds more than one class boundary,
+// so the first class of the bin is at most one class short
+template <const auto& SIZES, size_t FROM>
+class LogLinearSizeClassTable
+{
+	static_assert(SizeClassConstants::isValidClassTable(SIZES), "class sizes must be increasing multiples of 8");
+	static_assert((FROM & (FROM - 1)) == 0 && SizeClassConstants::log2Floor(FROM) >= SizeClassConstants::SUB_BIN_BITS, "FROM must be a large enough power of two");
+	static constexpr int COUNT = (int)SIZES.size();
+	static constexpr int FROM_LOG2 = SizeClassConstants::log2Floor(FROM);
+	static constexpr int BIN_COUNT = (SizeClassConstants::log2Floor(SIZES[COUNT - 1] - 1) - FROM_LOG2 + 1) << SizeClassConstants::SUB_BIN_BITS;
+	using Indices = std::array<uint8_t, BIN_COUNT>;
+
+	static constexpr int firstClassOfAtLeast(size_t size)
+	{
+		int index = 0;
+		while (index < COUNT - 1 && SIZES[index] < size)
+			index++;
+		return index;
+	}
+
+	// bin b holds the sizes in (lowest, lowest + width]
+	static constexpr size_t binLowest(int bin)
+	{
+		int exponent = FROM_LOG2 + bin / SizeClassConstants::SUB_BIN_COUNT;
+		return ((size_t)1 << exponent) | ((size_t)(bin % SizeClassConstants::SUB_BIN_COUNT) << (exponent - SizeClassConstants::SUB_BIN_BITS));
+	}
+	static constexpr size_t binWidth(int bin)
+	{
+		return (size_t)1 << (FROM_LOG2 + bin / SizeClassConstants::SUB_BIN_COUNT - SizeClassConstants::SUB_BIN_BITS);
+	}
+
+	static constexpr Indices makeIndices()
+	{
+		Indices ret{};
+		for (int bin = 0; bin < BIN_COUNT; bin++)
+			ret[bin] = (uint8_t)firstClassOfAtLeast(binLowest(bin) + 1);
+		return ret;
+	}
+	static constexpr Indices INDICES = makeIndices();
+
+	static constexpr bool isFineEnough()
+	{
+		for (int bin = 0; bin < BIN_COUNT; bin++)
+		{
+			if (firstClassOfAtLeast(binLowest(bin) + binWidth(bin)) > INDICES[bin] + 1)
+				return false;
+		}
+		return true;
+	}
+	static_assert(isFineEnough(), "classes are too dense for SUB_BIN_BITS");
+public:
+	// size must be in (FROM, largest class]
+	static int index(size_t size)
+	{
+		size_t value = size - 1;
+		int exponent = Platform::log2Floor(value);
+		int bin = ((exponent - FROM_LOG2) << SizeClassConstants::SUB_BIN_BITS)
+			| (int)((value >> (exponent - SizeClassConstants::SUB_BIN_BITS)) & (SizeClassConstants::SUB_BIN_COUNT - 1));
+		int index = INDICES[bin];
+		return index + (SIZES[index] < size);
+	}
+};
+
+namespace CustomMemoryManagerConstants
+{
+	constexpr size_t SMALL_THRESHOLD = 512;
+	constexpr size_t LARGE_THRESHOLD = 256 * (1 << 10);
+	inline constexpr std::array<size_t, 23> SMALL_BLOCK_SIZES
+		= {
+			8, 16, 24, 32, 40, 48, 56, 64, 72, 88, 104, 120, 136,
+			160, 184, 208, 240, 272, 312, 352, 400, 456, 512
+	};
+	inline constexpr std::array<size_t, 53> LARGE_BLOCK_SIZES
+		= {
+			576, 648, 736, 832, 936, 1056, 1192, 1344, 1512, 1704, 1920,
+			2160, 2432, 2736, 3080, 3472, 3912, 4408, 4960, 5584, 6288,
+			7080, 7968, 8968, 10096, 11360, 12784, 14384, 16184, 18208,
+			20488, 23056, 25944, 29192, 32848, 36960, 41584, 46784, 52632,
+			59216, 66624, 74952, 84328, 94872, 106736, 120080, 135096,
+			151984, 170984, 192360, 216408, 243464, 262144
+	};
+	// class sizes are multiples of 8, and so are the block addresses
+	constexpr size_t BLOCK_ALIGNMENT = 8;
+	constexpr int SMALL_CLASS_COUNT = (int)SMALL_BLOCK_SIZES.size();
+	constexpr int LARGE_CLASS_COUNT = (int)LARGE_BLOCK_SIZES.size();
+	static_assert(SMALL_BLOCK_SIZES[SMALL_CLASS_COUNT - 1] == SMALL_THRESHOLD && LARGE_BLOCK_SIZES[LARGE_CLASS_COUNT - 1] == LARGE_THRESHOLD,
+		"the largest classes must match the thresholds");
+	// sizes up to SMALL_THRESHOLD
+	using SmallSizeClasses = LinearSizeClassTable<SMALL_BLOCK_SIZES>;
+	// sizes in (SMALL_THRESHOLD, LARGE_THRESHOLD]
+	using LargeSizeClasses = LogLinearSizeClassTable<LARGE_BLOCK_SIZES, SMALL_THRESHOLD>;
+
+	// block size of the class serving size, up to LARGE_THRESHOLD
+	inline size_t classSize(size_t size)
+	{
+		return size <= SMALL_THRESHOLD ? SMALL_BLOCK_SIZES[SmallSizeClasses::index(size)] : LARGE_BLOCK_SIZES[LargeSizeClasses::index(size)];
+	}
+}
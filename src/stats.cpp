@@ -0,0 +1,62 @@
+#include "stats.h"
+
+#include <iomanip>
+
+namespace
+{
+	// the classes nothing was ever allocated from are left out
+	bool isUsed(const SizeClassStats& stats)
+	{
+		return stats.allocations != 0 || stats.pools != 0;
+	}
+}
+
+void printStats(std::ostream& out, const MemoryStats& stats)
+{
+	out << "reserved = " << stats.reservedBytes << ", free = " << stats.freeBytes << ", committed = " << stats.committedBytes << " bytes" << std::endl;
+	out << "pages: internal = " << stats.internalPages << ", huge = " << stats.hugePages
+		<< ", large = " << stats.largePages << ", small = " << stats.smallPages << std::endl;
+	out << "internal pool: used = " << stats.internalPoolUsedBytes << " of " << stats.internalPoolBytes << " bytes" << std::endl;
+	out << "huge blocks: allocations = " << stats.hugeAllocations << ", frees = " << stats.hugeFrees << std::endl;
+	out << "live block bytes = " << stats.liveBlockBytes << ", fragmentation = " << std::fixed << std::setprecision(4) << stats.fragmentation << std::endl;
+	out.unsetf(std::ios::fixed);
+	out << std::setprecision(6);
+	out << "lock contentions: arenas = " << stats.arenaLockContentions << ", small page pool = " << stats.smallPagePoolLockContentions
+		<< ", internal pool = " << stats.internalPoolLockContentions << std::endl;
+	out << "numa nodes = " << stats.numaNodes << ", cross-node frees = " << stats.crossNodeFrees << std::endl;
+	for (auto& c : stats.classes)
+	{
+		if (!isUsed(c))
+			continue;
+		out << "class " << c.blockSize << ": allocations = " << c.allocations << ", frees = " << c.frees
+			<< ", live = " << c.liveBlocks << ", cached = " << c.cachedBlocks << ", pools = " << c.pools
+			<< ", pool bytes = " << c.poolBytes << ", lock contentions = " << c.lockContentions << std::endl;
+	}
+}
+
+void printStatsJson(std::ostream& out, const MemoryStats& stats)
+{
+	out << "{\"reservedBytes\":" << stats.reservedBytes << ",\"freeBytes\":" << stats.freeBytes << ",\"committedBytes\":" << stats.committedBytes
+		<< ",\"pages\":{\"internal\":" << stats.internalPages << ",\"huge\":" << stats.hugePages
+		<< ",\"large\":" << stats.largePages << ",\"small\":" << stats.smallPages << "}"
+		<< ",\"internalPoolBytes\":" << stats.internalPoolBytes << ",\"internalPoolUsedBytes\":" << stats.internalPoolUsedBytes
+		<< ",\"hugeAllocations\":" << stats.hugeAllocations << ",\"hugeFrees\":" << stats.hugeFrees
+		<< ",\"liveBlockBytes\":" << stats.liveBlockBytes << ",\"fragmentation\":" << std::setprecision(6) << stats.fragmentation
+		<< ",\"lockContentions\":{\"arenas\":" << stats.arenaLockContentions << ",\"smallPagePool\":" << stats.smallPagePoolLockContentions
+		<< ",\"internalPool\":" << stats.internalPoolLockContentions << "}"
+		<< ",\"numaNodes\":" << stats.numaNodes << ",\"crossNodeFrees\":" << stats.crossNodeFrees
+		<< ",\"classes\":[";
+	bool isFirst = true;
+	for (auto& c : stats.classes)
+	{
+		if (!isUsed(c))
+			continue;
+		if (!isFirst)
+			out << ",";
+		isFirst = false;
+		out << "{\"blockSize\":" << c.blockSize << ",\"allocations\":" << c.allocations << ",\"frees\":" << c.frees
+			<< ",\"liveBlocks\":" << c.liveBlocks << ",\"cachedBlocks\":" << c.cachedBlocks << ",\"pools\":" << c.pools
+			<< ",\"poolBytes\":" << c.poolBytes << ",\"lockContentions\":" << c.lockContentions << "}";
+	}
+	out << "]}" << std::endl;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// statistics of a CustomMemoryManager, as collected by reportStats, and their dump as text or JSON
+// event counts are kept per thread and summed when collected, so counting is cheap
+// and a snapshot taken while other threads run is consistent only approximately
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+struct SizeClassStats
+{
+	size_t blockSize;
+	uint64_t allocations;
+	uint64_t frees;
+	// allocated and not freed
+	size_t liveBlocks;
+	// freed into thread caches and not yet returned to the pools
+	size_t cachedBlocks;
+	size_t pools;
+	// of the pools, the blocks not in use included
+	size_t poolBytes;
+	// acquisitions of the class lock that found it held
+	uint64_t lockContentions;
+};
+
+struct MemoryStats
+{
+	// the small classes, then the large ones
+	std::vector<SizeClassStats> classes;
+	// blocks over LARGE_THRESHOLD, served by the huge pools
+	uint64_t hugeAllocations;
+	uint64_t hugeFrees;
+	// 2 MiB pages by Page::PageType; the HUGE ones are free or hold huge blocks
+	size_t internalPages;
+	size_t hugePages;
+	size_t largePages;
+	size_t smallPages;
+	size_t internalPoolBytes;
+	size_t internalPoolUsedBytes;
+	// of the huge pools
+	size_t reservedBytes;
+	size_t freeBytes;
+	size_t committedBytes;
+	// of the live blocks of the block pools, at their class sizes
+	size_t liveBlockBytes;
+	uint64_t arenaLockContentions;
+	uint64_t smallPagePoolLockContentions;
+	uint64_t internalPoolLockContentions;
+	int numaNodes;
+	// blocks freed by a thread on another node than the one their memory was placed on
+	uint64_t crossNodeFrees;
+	// share of the bytes handed out by the huge pools that no live block uses:
+	// free blocks of the block pools and of the thread caches, and unused 4 KiB pools
+	double fragmentation;
+};
+
+// one line per figure, and one per size class in use
+void printStats(std::ostream& out, const MemoryStats& stats);
+// a single JSON object, for metrics exporters
+void printStatsJson(std::ostream& out, const MemoryStats& stats);
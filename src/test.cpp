@@ -1,14 +1,27 @@
 #include "memory_manager.h"
+#include "benchmark.h"
+#include "region.h"
 
+#include <algorithm>
 #include <iostream>
 #include <random>
 #include <thread>
 #include <vector>
 #include <set>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#ifndef _MSC_VER
+#include <malloc.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 // todo: debug the multi-threaded run
-// todo: change memory list pool to remove std::list, use the allocated space instead (n.b. alignment issue)
-// todo: memoryListPool -- make several freeList by size range
 
 // not robust against bad free calls and bad memory manipulations
 
@@ -16,14 +29,6 @@ using ll = long long;
 
 using namespace CustomMemoryManagerConstants;
 
-class BasicMemoryManager : public MemoryManager
-{
-	void* allocate(size_t size) override final { return std::malloc(size); }
-	void free(void* ptr) override final { std::free(ptr); }
-	size_t reportFreeSpace() override final { return 0; }
-	size_t reportTotalSpace() override final { return 0; }
-};
-
 void integrityTest(MemoryManager* manager, const size_t maxSize, int seed, const int maxElementSize)
 {
 	const int N = maxSize / maxElementSize;
@@ -126,7 +131,139 @@ void integrityTestHuge(MemoryManager* manager, const size_t maxSize, int seed)
 
 void integrityTestMixed(MemoryManager* manager, const size_t maxSize, int seed)
 {
+	WorkloadConfig config;
+	config.operations = maxSize / 4096;
+	config.verify = true;
+	BenchmarkResult result = runWorkload(manager, config, 1, seed);
+	if (result.errors > 0)
+		std::cerr << "wrong" << std::endl;
+}
 
+void integrityTestAligned(CustomMemoryManager* manager, const size_t maxSize, int seed)
+{
+	std::mt19937 generator(seed);
+	std::uniform_int_distribution<int> logAlignment(3, 21);
+	std::uniform_int_distribution<int> logSize(0, 23);
+	std::vector<std::pair<unsigned char*, size_t>> blocks;
+	size_t total = 0;
+	while (total < maxSize)
+	{
+		size_t alignment = (size_t)1 << logAlignment(generator);
+		size_t size = std::uniform_int_distribution<size_t>(0, (size_t)1 << logSize(generator))(generator);
+		unsigned char* ptr = (unsigned char*)manager->allocateAligned(size, alignment);
+		// the padding stays within the alignment plus the spacing of the classes
+		size_t usable = manager->usableSize(ptr);
+		if ((size_t)ptr % alignment != 0 || usable < size || usable > size + alignment + (size + alignment) / 4 + 64)
+			std::cerr << "wrong" << std::endl;
+		std::fill(ptr, ptr + size, (unsigned char)blocks.size());
+		blocks.emplace_back(ptr, size);
+		total += size;
+	}
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		if (std::count(blocks[i].first, blocks[i].first + blocks[i].second, (unsigned char)i) != (ptrdiff_t)blocks[i].second)
+			std::cerr << "wrong" << std::endl;
+		manager->free(blocks[i].first);
+	}
+}
+
+void integrityTestReallocate(MemoryManager* manager, const size_t maxSize, int seed)
+{
+	// buffers grow and shrink across all tiers; the common prefix must survive every move
+	const int N = 64;
+	std::mt19937 generator(seed);
+	std::uniform_int_distribution<int> logSize(0, 22);
+	std::uniform_int_distribution<int> pick(0, N - 1);
+	std::vector<unsigned char*> address(N);
+	std::vector<size_t> size(N);
+	size_t total = 0;
+	while (total < maxSize)
+	{
+		int i = pick(generator);
+		size_t newSize = std::uniform_int_distribution<size_t>(1, (size_t)1 << logSize(generator))(generator);
+		unsigned char* ptr = (unsigned char*)manager->reallocate(address[i], newSize);
+		size_t kept = std::min(size[i], newSize);
+		if (manager->usableSize(ptr) < newSize || std::count(ptr, ptr + kept, (unsigned char)i) != (ptrdiff_t)kept)
+			std::cerr << "wrong" << std::endl;
+		std::fill(ptr + kept, ptr + newSize, (unsigned char)i);
+		address[i] = ptr;
+		size[i] = newSize;
+		total += newSize - kept;
+	}
+	for (int i = 0; i < N; i++)
+		manager->reallocate(address[i], 0);
+}
+
+// the growth is the same every run, so the seed goes unused
+void performanceTestReallocate(MemoryManager* manager, const size_t maxSize, int)
+{
+	// vectors growing by half their size at a time, as containers do, with a few growing side by side
+	const int N = 4;
+	const size_t maxElementSize = 16 * (1 << 20);
+	std::vector<char*> address(N);
+	std::vector<size_t> size(N);
+	size_t total = 0;
+	while (total < maxSize)
+	{
+		for (int i = 0; i < N; i++)
+		{
+			size_t newSize = size[i] < maxElementSize ? std::max<size_t>(16, size[i] + size[i] / 2) : 0;
+			address[i] = (char*)manager->reallocate(address[i], newSize);
+			if (newSize > 0)
+				std::memset(address[i] + size[i], i, newSize - size[i]);
+			total += newSize - std::min(size[i], newSize);
+			size[i] = newSize;
+		}
+	}
+	for (int i = 0; i < N; i++)
+		manager->reallocate(address[i], 0);
+}
+
+void integrityTestBatch(MemoryManager* manager, const size_t maxSize, int seed)
+{
+	// requests of many same-sized nodes, freed in one batch or one by one with their size
+	const int N = 1024;
+	std::mt19937 generator(seed);
+	std::uniform_int_distribution<int> logSize(0, 19);
+	std::uniform_int_distribution<int> flag(0, 1);
+	std::vector<void*> blocks(N);
+	size_t total = 0;
+	while (total < maxSize)
+	{
+		size_t size = std::uniform_int_distribution<size_t>(1, (size_t)1 << logSize(generator))(generator);
+		int count = std::max<int>(1, std::min<size_t>(N, maxSize / 8 / size));
+		manager->allocateBatch(size, count, blocks.data());
+		for (int i = 0; i < count; i++)
+			std::memset(blocks[i], i, size);
+		for (int i = 0; i < count; i++)
+		{
+			unsigned char* ptr = (unsigned char*)blocks[i];
+			if (std::count(ptr, ptr + size, (unsigned char)i) != (ptrdiff_t)size)
+				std::cerr << "wrong" << std::endl;
+		}
+		if (flag(generator))
+			manager->freeBatch(blocks.data(), count);
+		else
+		{
+			for (int i = 0; i < count; i++)
+				manager->free(blocks[i], size);
+		}
+		total += size * count;
+	}
+}
+
+void performanceTestBatch(MemoryManager* manager, const size_t maxSize, int seed)
+{
+	// per request, a batch of nodes of one size, as a parser builds them, freed together
+	const int N = 1024;
+	std::mt19937 generator(seed);
+	std::uniform_int_distribution<int> size(8, 256);
+	std::vector<void*> blocks(N);
+	for (size_t total = 0; total < maxSize * 4; total += N * 256)
+	{
+		manager->allocateBatch(size(generator), N, blocks.data());
+		manager->freeBatch(blocks.data(), N);
+	}
 }
 
 void performanceTest(MemoryManager* manager, const size_t maxSize, int seed, const int maxElementSize) {
@@ -194,43 +331,791 @@ void performanceTestHuge(MemoryManager* manager, const size_t maxSize, int seed)
 	performanceTest(manager, maxSize, seed, 10 * (1 << 20));
 }
 
-void performanceTestMixed(MemoryManager* manager, const size_t maxSize, int seed)
+void performanceTestHugeFragmented(MemoryManager* manager, const size_t maxSize, int seed)
+{
+	// pin every other huge allocation so that the free space is split into many fragments
+	const int N = maxSize / LARGE_THRESHOLD;
+	std::mt19937 generator(seed);
+	std::uniform_int_distribution<int> distribution(LARGE_THRESHOLD + 1, 2 * LARGE_THRESHOLD);
+	std::vector<void*> address(N);
+	for (int i = 0; i < N; i++)
+		address[i] = manager->allocate(distribution(generator));
+	for (int i = 1; i < N; i += 2)
+		manager->free(address[i]);
+	performanceTest(manager, maxSize, seed, 1 << 20);
+	for (int i = 0; i < N; i += 2)
+		manager->free(address[i]);
+}
+
+void performanceTestProducerConsumer(MemoryManager* manager, const size_t maxSize, int seed)
 {
+	// this thread allocates, a second one frees; blocks are handed over in batches through a bounded queue
+	constexpr int BATCH_SIZE = 256;
+	constexpr int MAX_PENDING_BATCHES = 16;
+	const int N = maxSize / 2048 / BATCH_SIZE;
+	std::mt19937 generator(seed);
+	std::uniform_int_distribution<int> distribution(1, 4096);
+	std::mutex mutex;
+	std::condition_variable condition, producerCondition;
+	std::vector<std::vector<void*>> batches;
+	bool isDone = false;
 
+	std::thread consumer([&]() {
+		std::vector<std::vector<void*>> taken;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [&]() { return isDone || !batches.empty(); });
+				if (batches.empty())
+					return;
+				taken.swap(batches);
+			}
+			producerCondition.notify_one();
+			for (auto& batch : taken)
+				for (void* ptr : batch)
+					manager->free(ptr);
+			taken.clear();
+		}
+	});
+	for (int i = 0; i < N; i++)
+	{
+		std::vector<void*> batch(BATCH_SIZE);
+		for (int j = 0; j < BATCH_SIZE; j++)
+			batch[j] = manager->allocate(distribution(generator));
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			producerCondition.wait(lock, [&]() { return batches.size() < MAX_PENDING_BATCHES; });
+			batches.push_back(std::move(batch));
+		}
+		condition.notify_one();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		isDone = true;
+	}
+	condition.notify_one();
+	consumer.join();
 }
 
+void performanceTestMixed(MemoryManager* manager, const size_t maxSize, int seed)
+{
+	WorkloadConfig config;
+	config.operations = maxSize / 4096;
+	runWorkload(manager, config, 1, seed);
+}
+
+// per-thread magazines against per-CPU ones at each thread count, and malloc; the threads stay parked once done
+// so that the caches are measured while every thread is alive, as with mostly idle threads
 void measure(CustomMemoryManager* customManager, BasicMemoryManager* basicManager, const int maxSize, void (*f)(MemoryManager*, size_t, int))
 {
+	CustomMemoryManagerConfig perCpuConfig;
+	perCpuConfig.usePerCpuCaches = true;
+	CustomMemoryManager* perCpuManager = new CustomMemoryManager(perCpuConfig);
+	struct Run
+	{
+		const char* name;
+		MemoryManager* manager;
+		CustomMemoryManager* customManager;
+		// elapsed time of the single-threaded run; the ratio to it is the scaling curve
+		ll base;
+	};
+	Run runs[] = {
+		{ "CustomManager", customManager, customManager, 0 },
+		{ "CustomManager with per-CPU caches", perCpuManager, perCpuManager, 0 },
+		{ "BasicManager", basicManager, nullptr, 0 },
+	};
+	// they need rseq, without which the threads keep their thread caches
+	if (!perCpuManager->hasPerCpuCaches())
+		std::cout << "per-CPU caches unavailable" << std::endl;
 	for (int n = 1; n <= 32; n *= 2)
 	{
-		std::chrono::steady_clock::time_point start;
-		ll elapsed;
-		std::vector<std::thread> threads(n);
-
-		std::cout << "CustomManager - " << n << " threads started" << std::endl;
-		start = std::chrono::steady_clock::now();
-		// f(customManager, maxSize, 0);
-		for (int i = 0; i < n; i++)
-			threads[i] = std::thread(f, (MemoryManager*)customManager, maxSize/n, i);
-		for (int i = 0; i < n; i++)
-			threads[i].join();
-		elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
-		std::cout << "CustomManager - " << n << " threads ended: " << elapsed << "ms" << std::endl;
-		std::cout << "free space = " << customManager->reportFreeSpace() / (1 << 20) << "MiB" << std::endl;
-		std::cout << "total space = " << customManager->reportTotalSpace() / (1 << 20) << "MiB" << std::endl;
-
-		std::cout << "BasicManager - " << n << " threads started" << std::endl;
-		start = std::chrono::steady_clock::now();
-		// f(basicManager, maxSize, 0);
-		for (int i = 0; i < n; i++)
-			threads[i] = std::thread(f, (MemoryManager*)basicManager, maxSize/n, i);
-		for (int i = 0; i < n; i++)
-			threads[i].join();
-		elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
-		std::cout << "BasicManager - " << n << " threads ended: " << elapsed << "ms" << std::endl;
+		for (Run& run : runs)
+		{
+			std::mutex mutex;
+			std::condition_variable finished;
+			std::condition_variable released;
+			int done = 0;
+			bool isReleased = false;
+			std::vector<std::thread> threads(n);
+
+			std::cout << run.name << " - " << n << " threads started" << std::endl;
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < n; i++)
+			{
+				threads[i] = std::thread([&, i]() {
+					f(run.manager, maxSize / n, i);
+					std::unique_lock<std::mutex> lock(mutex);
+					if (++done == n)
+						finished.notify_one();
+					released.wait(lock, [&]() { return isReleased; });
+				});
+			}
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				finished.wait(lock, [&]() { return done == n; });
+			}
+			ll elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			std::cout << run.name << " - " << n << " threads ended: " << elapsed << "ms" << std::endl;
+			if (n == 1)
+				run.base = elapsed;
+			std::cout << "speedup = " << (double)run.base / std::max(elapsed, 1LL) << std::endl;
+			if (run.customManager != nullptr)
+			{
+				MemoryStats stats = run.customManager->reportStats();
+				size_t cachedBytes = 0;
+				for (auto& sizeClass : stats.classes)
+					cachedBytes += sizeClass.cachedBlocks * sizeClass.blockSize;
+				std::cout << "free space = " << run.customManager->reportFreeSpace() / (1 << 20) << "MiB" << std::endl;
+				std::cout << "total space = " << run.customManager->reportTotalSpace() / (1 << 20) << "MiB" << std::endl;
+				std::cout << "cached = " << cachedBytes / (1 << 10) << "KiB, internal pool used = " << stats.internalPoolUsedBytes / (1 << 10) << "KiB" << std::endl;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				isReleased = true;
+			}
+			released.notify_all();
+			for (auto& thread : threads)
+				thread.join();
+		}
+	}
+	delete perCpuManager;
+}
+
+// the lookup tables must agree with a search of the class sizes everywhere
+void sizeClassTest()
+{
+	for (size_t size = 1; size <= LARGE_THRESHOLD; size++)
+	{
+		int expected = size <= SMALL_THRESHOLD
+			? std::lower_bound(SMALL_BLOCK_SIZES.begin(), SMALL_BLOCK_SIZES.end(), size) - SMALL_BLOCK_SIZES.begin()
+			: std::lower_bound(LARGE_BLOCK_SIZES.begin(), LARGE_BLOCK_SIZES.end(), size) - LARGE_BLOCK_SIZES.begin();
+		int index = size <= SMALL_THRESHOLD ? SmallSizeClasses::index(size) : LargeSizeClasses::index(size);
+		if (index != expected)
+		{
+			std::cout << "wrong: size class of " << size << " = " << index << ", expected " << expected << std::endl;
+			return;
+		}
+	}
+}
+
+// threads push and pop their own entries, singly and in chains; the stack size must match what is left on it
+void atomicStackTest()
+{
+	constexpr int THREADS = 4;
+	constexpr int ENTRIES = 1 << 10;
+	AtomicStack stack;
+	std::vector<AtomicStack::Entry> entries(THREADS * ENTRIES);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; t++)
+	{
+		threads.emplace_back([&, t] {
+			std::mt19937 generator(t);
+			std::vector<AtomicStack::Entry*> mine;
+			for (int i = 0; i < ENTRIES; i++)
+				mine.push_back(&entries[t * ENTRIES + i]);
+			for (int round = 0; round < 1 << 16; round++)
+			{
+				int count = 1 + generator() % 8;
+				if (generator() % 2 == 0 && (int)mine.size() >= count)
+				{
+					for (int i = 0; i < count - 1; i++)
+						mine[mine.size() - 1 - i]->next = mine[mine.size() - 2 - i];
+					stack.pushChain(mine.back(), mine[mine.size() - count], count);
+					mine.resize(mine.size() - count);
+				}
+				else
+				{
+					AtomicStack::Entry* entry = stack.popChain(count);
+					for (int i = 0; i < count; i++, entry = entry->next)
+						mine.push_back(entry);
+				}
+			}
+			for (AtomicStack::Entry* entry : mine)
+				stack.push(entry);
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	int count;
+	AtomicStack::Entry* entry = stack.popAll(count);
+	int listed = 0;
+	for (; entry != nullptr; entry = entry->next)
+		listed++;
+	if (count != THREADS * ENTRIES || listed != count || stack.size() != 0)
+		std::cout << "wrong: atomic stack size = " << count << ", listed = " << listed << ", expected " << THREADS * ENTRIES << std::endl;
+}
+
+// per-call cost of finding the size class, by searching the class sizes and by the lookup tables
+void sizeClassBenchmark()
+{
+	constexpr int N = 1 << 12;
+	constexpr int ROUNDS = 1 << 12;
+	std::mt19937 generator(0);
+	std::vector<size_t> smallSizes(N), largeSizes(N);
+	for (int i = 0; i < N; i++)
+	{
+		smallSizes[i] = std::uniform_int_distribution<size_t>(1, SMALL_THRESHOLD)(generator);
+		largeSizes[i] = std::uniform_int_distribution<size_t>(SMALL_THRESHOLD + 1, LARGE_THRESHOLD)(generator);
+	}
+	// returns the sum of the indices, which keeps the lookups from being optimized away
+	auto time = [&](const char* name, const std::vector<size_t>& sizes, auto lookup) {
+		ll sum = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int round = 0; round < ROUNDS; round++)
+		{
+			for (size_t size : sizes)
+				sum += lookup(size);
+		}
+		double elapsed = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		std::cout << name << ": " << elapsed / ((double)ROUNDS * N) << "ns per call" << std::endl;
+		return sum;
+	};
+	ll searched = time("small, lower_bound", smallSizes, [](size_t size) { return std::lower_bound(SMALL_BLOCK_SIZES.begin(), SMALL_BLOCK_SIZES.end(), size) - SMALL_BLOCK_SIZES.begin(); });
+	if (time("small, table", smallSizes, [](size_t size) { return SmallSizeClasses::index(size); }) != searched)
+		std::cout << "wrong: small size classes differ" << std::endl;
+	searched = time("large, lower_bound", largeSizes, [](size_t size) { return std::lower_bound(LARGE_BLOCK_SIZES.begin(), LARGE_BLOCK_SIZES.end(), size) - LARGE_BLOCK_SIZES.begin(); });
+	if (time("large, table", largeSizes, [](size_t size) { return LargeSizeClasses::index(size); }) != searched)
+		std::cout << "wrong: large size classes differ" << std::endl;
+}
+
+// resident memory per live byte, for blocks of one class at a time
+void poolUtilizationTest(const size_t maxSize)
+{
+	// block pool pages keep no header of their huge pool in band, so that the largest class fits a page 8 times
+	if (!HardeningConstants::IS_HARDENED)
+	{
+		CustomMemoryManager* manager = new CustomMemoryManager();
+		void* blocks[LARGE_POOL_SIZE / LARGE_THRESHOLD];
+		for (auto& block : blocks)
+			block = manager->allocate(LARGE_THRESHOLD);
+		MemoryStats stats = manager->reportStats();
+		if (stats.largePages != 1)
+			std::cout << "wrong: " << LARGE_POOL_SIZE / LARGE_THRESHOLD << " blocks of " << LARGE_THRESHOLD << " bytes on " << stats.largePages << " pages" << std::endl;
+		for (auto block : blocks)
+			manager->free(block);
+		delete manager;
+	}
+	for (size_t size : { 8, 16, 32, 64, 128, 512, 4096 })
+	{
+		CustomMemoryManager* manager = new CustomMemoryManager();
+		std::vector<void*> blocks(maxSize / 8 / size);
+		const size_t before = Platform::residentBytes();
+		for (auto& block : blocks)
+		{
+			block = manager->allocate(size);
+			std::memset(block, 1, size);
+		}
+		const size_t after = Platform::residentBytes();
+		std::cout << size << " byte blocks: live = " << blocks.size() * size / (1 << 20) << "MiB, RSS growth = " << (after - before) / (1 << 20)
+			<< "MiB, utilization = " << (double)(blocks.size() * size) / std::max<size_t>(after - before, 1) << std::endl;
+		for (auto block : blocks)
+			manager->free(block);
+		delete manager;
 	}
 }
 
+// performanceTestSmall, and the same over the classes that use bitmaps only
+void bitmapPoolTest(const size_t maxSize)
+{
+	for (int maxElementSize : { MAX_BITMAP_BLOCK_SIZE, (int)SMALL_THRESHOLD })
+	{
+		for (int n = 1; n <= 4; n *= 4)
+		{
+			for (bool useBitmapPools : { false, true })
+			{
+				CustomMemoryManagerConfig config;
+				config.useBitmapPools = useBitmapPools;
+				CustomMemoryManager* manager = new CustomMemoryManager(config);
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				std::vector<std::thread> threads;
+				for (int i = 0; i < n; i++)
+					threads.emplace_back(performanceTest, manager, maxSize / n, i, maxElementSize);
+				for (auto& thread : threads)
+					thread.join();
+				ll elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				std::cout << "sizes up to " << maxElementSize << ", " << (useBitmapPools ? "bitmap" : "free list") << " pools - " << n << " threads ended: " << elapsed << "ms" << std::endl;
+				delete manager;
+			}
+		}
+	}
+}
+
+// counts of blocks allocated and freed by exited threads, and of blocks left in the calling thread's cache
+void statsTest()
+{
+	constexpr int THREADS = 4;
+	constexpr int COUNT = 1 << 12;
+	const std::vector<size_t> sizes = { 24, 1000, 100'000, 1 << 20 };
+	CustomMemoryManager* manager = new CustomMemoryManager();
+	std::vector<std::vector<void*>> blocks(THREADS);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; t++)
+	{
+		threads.emplace_back([&, t] {
+			for (int i = 0; i < COUNT; i++)
+				blocks[t].push_back(manager->allocate(sizes[i % sizes.size()]));
+			for (int i = 0; i < COUNT / 2; i++)
+				manager->free(blocks[t][i]);
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	for (int i = 0; i < COUNT; i++)
+		manager->free(manager->allocate(40));
+
+	MemoryStats stats = manager->reportStats();
+	const uint64_t perSize = THREADS * COUNT / sizes.size();
+	// the hardened build counts a block as freed only once it leaves the quarantine
+	for (size_t size : { sizes[0], sizes[1], sizes[2] })
+	{
+		const SizeClassStats& c = stats.classes[size <= SMALL_THRESHOLD ? SmallSizeClasses::index(size) : SMALL_CLASS_COUNT + LargeSizeClasses::index(size)];
+		// the caches of the exited threads went back to the pools
+		if (!HardeningConstants::IS_HARDENED
+			&& (c.allocations != perSize || c.frees != perSize / 2 || c.liveBlocks != perSize / 2 || c.cachedBlocks != 0 || c.pools == 0))
+			std::cout << "wrong: class " << c.blockSize << " stats" << std::endl;
+	}
+	const SizeClassStats& cached = stats.classes[SmallSizeClasses::index(40)];
+	if (!HardeningConstants::IS_HARDENED && (cached.allocations != COUNT || cached.liveBlocks != 0 || cached.cachedBlocks == 0))
+		std::cout << "wrong: class " << cached.blockSize << " stats" << std::endl;
+	if (stats.hugeAllocations != perSize || stats.hugeFrees != perSize / 2 || stats.largePages == 0 || stats.smallPages == 0)
+		std::cout << "wrong: huge block and page stats" << std::endl;
+	printStats(std::cout, stats);
+	printStatsJson(std::cout, stats);
+
+	for (auto& list : blocks)
+	{
+		for (int i = COUNT / 2; i < COUNT; i++)
+			manager->free(list[i]);
+	}
+	delete manager;
+}
+
+// the integrity tests with sampling on, and a profile of blocks left live by two call sites
+void heapProfilerTest(const size_t maxSize)
+{
+	CustomMemoryManagerConfig config;
+	config.profileSampleBytes = 64 * (1 << 10);
+	CustomMemoryManager* manager = new CustomMemoryManager(config);
+	integrityTestSmall(manager, maxSize / 10, 1);
+	integrityTestMixed(manager, maxSize, 1);
+	integrityTestAligned(manager, maxSize / 10, 1);
+	integrityTestReallocate(manager, maxSize / 10, 1);
+
+	constexpr int COUNT = 1 << 14;
+	std::vector<void*> small, large;
+	auto allocateSmall = [&]() { small.push_back(manager->allocate(64)); };
+	auto allocateLarge = [&]() { large.push_back(manager->allocate(4096)); };
+	for (int i = 0; i < COUNT; i++)
+	{
+		allocateSmall();
+		allocateLarge();
+	}
+	std::ostringstream profile;
+	manager->writeHeapProfile(profile);
+	const std::string text = profile.str();
+	// about COUNT * (64 + 4096) / sampleBytes samples, under two stacks at least
+	size_t samples = 0, bytes = 0;
+	if (std::sscanf(text.c_str(), "heap profile: %zu: %zu", &samples, &bytes) != 2 || samples < 512 || samples > 2048
+		|| std::count(text.begin(), text.end(), '@') < 3 || text.find("MAPPED_LIBRARIES:") == std::string::npos)
+		std::cout << "wrong: heap profile" << std::endl << text.substr(0, 1024) << std::endl;
+	std::cout << samples << " samples of " << bytes << " bytes live" << std::endl;
+
+	for (void* ptr : small)
+		manager->free(ptr, 64);
+	for (void* ptr : large)
+		manager->free(ptr);
+	profile.str("");
+	manager->writeHeapProfile(profile);
+	if (profile.str().rfind("heap profile: 0: 0", 0) != 0)
+		std::cout << "wrong: samples left after all frees" << std::endl << profile.str().substr(0, 1024) << std::endl;
+	delete manager;
+}
+
+#ifndef _MSC_VER
+// runs f in a child process, which is to be killed by signal
+template <typename F>
+bool diesWith(int signal, F f)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		// the child's report is expected
+		std::freopen("/dev/null", "w", stderr);
+		f();
+		std::_Exit(0);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return WIFSIGNALED(status) && WTERMSIG(status) == signal;
+}
+#endif
+
+// the integrity tests in the hardened build, and each kind of misuse stopped by it
+void hardeningTest(const size_t maxSize)
+{
+	if (!HardeningConstants::IS_HARDENED)
+	{
+		std::cout << "skipped: built without MEMORY_MANAGER_HARDENED" << std::endl;
+		return;
+	}
+	CustomMemoryManagerConfig config;
+	config.useGuardPages = true;
+	CustomMemoryManager* manager = new CustomMemoryManager(config);
+	integrityTestMixed(manager, maxSize / 10, 1);
+	integrityTestAligned(manager, maxSize / 10, 1);
+	integrityTestReallocate(manager, maxSize / 10, 1);
+	integrityTestBatch(manager, maxSize / 10, 1);
+
+	// the canary is past the usable bytes, and a freed block waits in the quarantine
+	void* block = manager->allocate(64);
+	if (manager->usableSize(block) < 64 || manager->usableSize(block) + HardeningConstants::CANARY_SIZE > classSize(64 + HardeningConstants::CANARY_SIZE))
+		std::cout << "wrong: usable size " << manager->usableSize(block) << std::endl;
+	manager->free(block);
+	std::vector<void*> blocks;
+	for (int i = 0; i < 1000; i++)
+	{
+		blocks.push_back(manager->allocate(64));
+		if (blocks.back() == block)
+			std::cout << "wrong: freed block reused right away" << std::endl;
+	}
+	manager->freeBatch(blocks.data(), (int)blocks.size());
+
+	// huge blocks end at their trailing guard page
+	const size_t hugeSize = LARGE_THRESHOLD + 100;
+	char* huge = (char*)manager->allocate(hugeSize);
+	char* aligned = (char*)manager->allocateAligned(hugeSize, 1 << 16);
+	if (((size_t)huge + manager->usableSize(huge)) % Platform::SYSTEM_PAGE_SIZE != 0 || manager->usableSize(huge) < hugeSize
+		|| (size_t)aligned % (1 << 16) != 0 || manager->usableSize(aligned) < hugeSize)
+		std::cout << "wrong: guarded huge blocks" << std::endl;
+	std::memset(huge, 1, manager->usableSize(huge));
+	huge = (char*)manager->reallocate(huge, 2 * hugeSize);
+	if (huge[hugeSize - 1] != 1)
+		std::cout << "wrong: guarded huge block reallocated" << std::endl;
+	manager->free(huge);
+	manager->free(aligned);
+
+#ifndef _MSC_VER
+	int local = 0;
+	auto expect = [](bool isStopped, const char* misuse) {
+		if (!isStopped)
+			std::cout << "wrong: " << misuse << " not stopped" << std::endl;
+	};
+	expect(diesWith(SIGABRT, [&]() { void* ptr = manager->allocate(100); manager->free(ptr); manager->free(ptr); }), "double free");
+	expect(diesWith(SIGABRT, [&]() {
+		char* ptr = (char*)manager->allocate(100);
+		ptr[manager->usableSize(ptr)] = 0;
+		manager->free(ptr);
+	}), "write past a block");
+	expect(diesWith(SIGABRT, [&]() {
+		char* ptr = (char*)manager->allocate(100);
+		manager->free(ptr);
+		ptr[50] = 0;
+		// pushes the block out of the quarantine
+		for (int i = 0; i < HardeningConstants::QUARANTINE_BLOCKS; i++)
+			manager->free(manager->allocate(100));
+	}), "write after free");
+	expect(diesWith(SIGABRT, [&]() { manager->free(&local); }), "free of a foreign pointer");
+	expect(diesWith(SIGABRT, [&]() { void* ptr = manager->allocate(hugeSize); manager->free(ptr); manager->free(ptr); }), "huge double free");
+	expect(diesWith(SIGSEGV, [&]() {
+		char* ptr = (char*)manager->allocate(hugeSize);
+		ptr[manager->usableSize(ptr)] = 0;
+	}), "write past a huge block");
+#endif
+	delete manager;
+}
+
+void hugePageTest(const size_t maxSize)
+{
+	CustomMemoryManagerConfig config;
+	config.useHugePages = true;
+	CustomMemoryManager* manager = new CustomMemoryManager(config);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	performanceTestLarge(manager, maxSize, 0);
+	ll elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	HugePageStats stats = manager->reportHugePages();
+	std::cout << "HugePageTest ended: " << elapsed << "ms" << std::endl;
+	std::cout << "hugetlb pages = " << stats.hugetlbPages << ", THP advised pages = " << stats.transparentHugeAdvisedPages
+		<< ", THP resident pages = " << stats.transparentHugeResidentPages << ", hugetlb block pool pages = " << stats.hugetlbBlockPoolPages << std::endl;
+	// every huge pool is backed one way or the other, unless the system has neither
+	const size_t pages = manager->reportTotalSpace() / LARGE_POOL_SIZE;
+	if (stats.hugetlbPages + stats.transparentHugeAdvisedPages != 0 && stats.hugetlbPages + stats.transparentHugeAdvisedPages != pages)
+		std::cout << "wrong: " << stats.hugetlbPages + stats.transparentHugeAdvisedPages << " of " << pages << " pages backed by huge pages" << std::endl;
+	if (stats.hugetlbBlockPoolPages > stats.hugetlbPages || stats.transparentHugeResidentPages > stats.transparentHugeAdvisedPages)
+		std::cout << "wrong: huge page stats" << std::endl;
+	// hugetlb pages are given back whole
+	const size_t purged = manager->purge(true);
+	if (stats.hugetlbPages == pages && purged % LARGE_POOL_SIZE != 0)
+		std::cout << "wrong: " << purged << " bytes purged from hugetlb pages" << std::endl;
+	delete manager;
+}
+
+void purgeTest(const size_t maxSize)
+{
+	CustomMemoryManagerConfig config;
+	config.purgeDecayMs = 100;
+	CustomMemoryManager* manager = new CustomMemoryManager(config);
+	performanceTestHuge(manager, maxSize, 0);
+	std::cout << "before purge: committed space = " << manager->reportCommittedSpace() / (1 << 20) << "MiB"
+		<< ", total space = " << manager->reportTotalSpace() / (1 << 20) << "MiB" << std::endl;
+	std::this_thread::sleep_for(std::chrono::milliseconds(config.purgeDecayMs));
+	const size_t committed = manager->reportCommittedSpace();
+	size_t purged = manager->purge();
+	std::cout << "purged " << purged / (1 << 20) << "MiB: committed space = " << manager->reportCommittedSpace() / (1 << 20) << "MiB"
+		<< ", total space = " << manager->reportTotalSpace() / (1 << 20) << "MiB" << std::endl;
+	if (purged == 0 || manager->reportCommittedSpace() != committed - purged)
+		std::cout << "wrong: " << purged << " bytes purged, committed space " << committed << " -> " << manager->reportCommittedSpace() << std::endl;
+	delete manager;
+
+	// a lone block pool page freed between two in use gives back all but the system page holding the free block's header
+	if (!HardeningConstants::IS_HARDENED)
+	{
+		manager = new CustomMemoryManager(config);
+		constexpr int PER_PAGE = LARGE_POOL_SIZE / LARGE_THRESHOLD;
+		std::vector<void*> blocks(3 * PER_PAGE);
+		for (auto& block : blocks)
+			block = manager->allocate(LARGE_THRESHOLD);
+		// the rest of the huge pool first
+		manager->purge(true);
+		// the last page's pool heads the queue, so that the middle one is released once empty
+		manager->free(blocks[2 * PER_PAGE]);
+		for (int i = PER_PAGE; i < 2 * PER_PAGE; i++)
+			manager->free(blocks[i]);
+		const size_t before = manager->reportCommittedSpace();
+		purged = manager->purge(true);
+		if (purged != LARGE_POOL_SIZE - Platform::SYSTEM_PAGE_SIZE || manager->reportCommittedSpace() != before - purged)
+			std::cout << "wrong: " << purged << " bytes purged of a free page, committed space " << before << " -> " << manager->reportCommittedSpace() << std::endl;
+		for (int i = 0; i < PER_PAGE; i++)
+			manager->free(blocks[i]);
+		for (int i = 2 * PER_PAGE + 1; i < 3 * PER_PAGE; i++)
+			manager->free(blocks[i]);
+		delete manager;
+	}
+}
+
+void mixedBenchmark(const size_t maxSize)
+{
+	// the custom manager is rebuilt for every run so that its RSS starts from zero
+	BasicMemoryManager basicManager;
+	for (double crossThreadShare : { 0.0, 0.5 })
+	{
+		for (int n = 1; n <= 4; n *= 4)
+		{
+			// a single thread has no one to hand objects over to
+			if (crossThreadShare > 0 && n == 1)
+				continue;
+			WorkloadConfig config;
+			config.operations = maxSize / 4096;
+			config.crossThreadShare = crossThreadShare;
+			std::string suffix = " - " + std::to_string(n) + " threads, " + std::to_string((int)(crossThreadShare * 100)) + "% cross-thread frees";
+			CustomMemoryManager* customManager = new CustomMemoryManager();
+			printResult("CustomManager" + suffix, runWorkload(customManager, config, n, 0));
+			delete customManager;
+			printResult("BasicManager" + suffix, runWorkload(&basicManager, config, n, 0));
+			printResult("malloc" + suffix, runWorkload(nullptr, config, n, 0));
+		}
+	}
+}
+
+// a workload with cross-thread frees recorded to a trace, which is then replayed against each manager
+void traceTest(const size_t maxSize)
+{
+	const char* path = "trace_test.bin";
+	CustomMemoryManagerConfig traceConfig;
+	traceConfig.tracePath = path;
+	CustomMemoryManager* manager = new CustomMemoryManager(traceConfig);
+	WorkloadConfig config;
+	config.operations = maxSize / 4096;
+	config.crossThreadShare = 0.25;
+	runWorkload(manager, config, 4, 0);
+	void* aligned = manager->allocateAligned(100, 256);
+	void* moved = manager->reallocate(manager->allocate(10), 1000);
+	manager->free(aligned);
+	manager->free(moved, 1000);
+	delete manager;
+
+	Trace trace;
+	if (!readTrace(path, trace) || trace.threads.size() != 5)
+	{
+		std::cout << "wrong: trace not recorded" << std::endl;
+		return;
+	}
+	ReplayPlan plan = planReplay(trace);
+	// the workload's blocks, the aligned one, and both blocks of the reallocation
+	if (plan.blockSizes.size() != config.operations / 4 * 4 + 3 || plan.unmatched != 0 || !plan.unfreed.empty())
+		std::cout << "wrong: " << plan.blockSizes.size() << " blocks, " << plan.unmatched << " unmatched frees, " << plan.unfreed.size() << " unfreed blocks" << std::endl;
+	CustomMemoryManager* customManager = new CustomMemoryManager();
+	printResult("CustomManager replay", replayTrace(customManager, plan));
+	delete customManager;
+	BasicMemoryManager basicManager;
+	printResult("BasicManager replay", replayTrace(&basicManager, plan));
+	printResult("malloc replay", replayTrace(nullptr, plan));
+	std::remove(path);
+}
+
+// blocks of every kind land on the node of the thread that allocated them; on a single node there is nothing to cross
+// a huge block shrunk into the classes moves there, and one shrunk within the huge tier stays in place,
+// but for the hardened build, which moves every huge block
+void reallocateTierTest()
+{
+	CustomMemoryManager* manager = new CustomMemoryManager();
+	char* ptr = (char*)manager->allocate(1 << 20);
+	std::memset(ptr, 1, 100);
+	char* shrunk = (char*)manager->reallocate(ptr, 100);
+	if (std::count(shrunk, shrunk + 100, 1) != 100 || manager->usableSize(shrunk) > CustomMemoryManagerConstants::LARGE_THRESHOLD)
+		std::cout << "wrong: shrunk block of " << manager->usableSize(shrunk) << " bytes" << std::endl;
+	manager->free(shrunk, 100);
+	manager->free(manager->allocate(100), 100);
+	MemoryStats stats = manager->reportStats();
+	if (stats.hugeAllocations != 1 || stats.hugeFrees != 1)
+		std::cout << "wrong: " << stats.hugeAllocations << " huge allocations, " << stats.hugeFrees << " huge frees" << std::endl;
+	ptr = (char*)manager->allocate(1 << 20);
+	char* kept = (char*)manager->reallocate(ptr, 1 << 19);
+	if (!HardeningConstants::IS_HARDENED && (kept != ptr || manager->usableSize(kept) < (1 << 19)))
+		std::cout << "wrong: huge block not shrunk in place" << std::endl;
+	manager->free(kept);
+	delete manager;
+}
+
+// a sized free of a block that is not of the class of the size goes through free
+void sizedFreeTest()
+{
+	CustomMemoryManager* manager = new CustomMemoryManager();
+	void* huge = manager->allocate(1 << 20);
+	manager->free(huge, 100);
+	void* aligned = manager->allocateAligned(100, 4096);
+	manager->free(aligned, 100);
+	MemoryStats stats = manager->reportStats();
+	if (stats.hugeFrees != stats.hugeAllocations || stats.liveBlockBytes != 0)
+		std::cout << "wrong: " << stats.hugeFrees << " of " << stats.hugeAllocations << " huge blocks freed, " << stats.liveBlockBytes << " live bytes" << std::endl;
+	delete manager;
+}
+
+void numaTest()
+{
+	CustomMemoryManager* manager = new CustomMemoryManager();
+	const int node = Platform::currentNumaNode();
+	for (size_t size : { (size_t)16, (size_t)4096, (size_t)(1 << 20) })
+	{
+		char* ptr = (char*)manager->allocate(size);
+		std::memset(ptr, 1, size);
+		const int placed = Platform::pageNumaNode(ptr);
+		// -1 where placement cannot be queried
+		if (placed != -1 && placed != node)
+			std::cout << "wrong: " << size << " byte block on node " << placed << " of thread on node " << node << std::endl;
+		manager->free(ptr);
+	}
+	MemoryStats stats = manager->reportStats();
+	if (stats.numaNodes != std::min(Platform::numaNodeCount(), CustomMemoryManagerConstants::MAX_NUMA_NODES) || stats.crossNodeFrees != 0)
+		std::cout << "wrong: " << stats.numaNodes << " nodes, " << stats.crossNodeFrees << " cross-node frees" << std::endl;
+	std::cout << "numa nodes = " << stats.numaNodes << ", thread on node " << node << std::endl;
+	delete manager;
+}
+
+// region allocations are aligned and disjoint, rewinding and resetting reuse the same memory,
+// and the chunks go back to the manager on release
+void regionTest(const size_t maxSize)
+{
+	CustomMemoryManager* manager = new CustomMemoryManager();
+	Region* region = new Region(manager);
+	std::mt19937 gen(0);
+	std::uniform_int_distribution<int> sizeDist(1, 1000);
+	std::uniform_int_distribution<int> alignmentDist(0, 6);
+	std::vector<std::pair<unsigned char*, int>> objects;
+	size_t total = 0;
+	for (int round = 0; round < 2; round++)
+	{
+		void* firstObject = nullptr;
+		size_t firstAlignment = 0;
+		objects.clear();
+		total = 0;
+		while (total < maxSize / 10)
+		{
+			int size = sizeDist(gen);
+			size_t alignment = (size_t)1 << alignmentDist(gen);
+			unsigned char* ptr = (unsigned char*)region->allocate(size, alignment);
+			if ((size_t)ptr % alignment != 0)
+				std::cout << "wrong: region block not aligned to " << alignment << std::endl;
+			if (firstObject == nullptr)
+			{
+				firstObject = ptr;
+				firstAlignment = alignment;
+			}
+			std::memset(ptr, (int)objects.size() & 0xff, size);
+			objects.emplace_back(ptr, size);
+			total += size;
+		}
+		for (int i = 0; i < (int)objects.size(); i++)
+		{
+			for (int j = 0; j < objects[i].second; j++)
+			{
+				if (objects[i].first[j] != (i & 0xff))
+				{
+					std::cout << "wrong: region blocks overlap" << std::endl;
+					break;
+				}
+			}
+		}
+		const size_t held = region->reportTotalSpace();
+		region->reset();
+		// the same chunks again
+		if (region->allocate(1, firstAlignment) != firstObject)
+			std::cout << "wrong: reset region starts elsewhere" << std::endl;
+		region->reset();
+		if (round == 1 && region->reportTotalSpace() != held)
+			std::cout << "wrong: reset region grew from " << held << " to " << region->reportTotalSpace() << " bytes" << std::endl;
+	}
+
+	{
+		RegionScope scope(*region);
+		void* before = region->allocate(64);
+		{
+			RegionScope inner(*region);
+			region->allocate(100);
+			// larger than a chunk, freed by the rewind
+			std::memset(region->allocate(RegionConstants::CHUNK_SIZE * 2), 1, RegionConstants::CHUNK_SIZE * 2);
+		}
+		if (region->allocate(100) != (char*)before + 64)
+			std::cout << "wrong: region not rewound" << std::endl;
+	}
+
+	{
+		RegionResource resource(*region);
+		std::pmr::vector<std::pmr::string> strings(&resource);
+		for (int i = 0; i < 10000; i++)
+			strings.emplace_back(std::to_string(i) + " is a string long enough to be allocated");
+		if (strings[1234] != "1234 is a string long enough to be allocated")
+			std::cout << "wrong: pmr string " << strings[1234] << std::endl;
+	}
+
+	// many small objects dropped at once, against allocating and freeing each
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<void*> blocks(10000);
+	for (int round = 0; round < 100; round++)
+	{
+		for (void*& block : blocks)
+			block = manager->allocate(48);
+		for (void* block : blocks)
+			manager->free(block, 48);
+	}
+	ll managerElapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	start = std::chrono::steady_clock::now();
+	for (int round = 0; round < 100; round++)
+	{
+		for (void*& block : blocks)
+			block = region->allocate(48);
+		region->reset();
+	}
+	ll regionElapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "1M objects of 48 bytes: allocate and free " << managerElapsed << "us, region " << regionElapsed << "us" << std::endl;
+
+	delete region;
+	MemoryStats stats = manager->reportStats();
+	if (stats.hugeAllocations != stats.hugeFrees)
+		std::cout << "wrong: " << stats.hugeAllocations - stats.hugeFrees << " region chunks not released" << std::endl;
+	delete manager;
+}
+
 int main()
 {
 	CustomMemoryManager* customManager = new CustomMemoryManager();
@@ -240,12 +1125,17 @@ int main()
 	std::cout << "Integrity Test Start" << std::endl;
 
 	std::cout << "Single Thread Test" << std::endl;
+	sizeClassTest();
+	atomicStackTest();
 	integrityTestSmall(customManager, maxSize/10, 999'999'999);
 	integrityTestSmall(customManager, maxSize , 999'999'999);
 	integrityTestLarge(customManager, maxSize/10, 999'999'999);
 	integrityTestLarge(customManager, maxSize, 999'999'999);
 	integrityTestHuge(customManager, maxSize/10, 999'999'999);
 	integrityTestHuge(customManager, maxSize, 999'999'999);
+	integrityTestAligned(customManager, maxSize, 999'999'999);
+	integrityTestReallocate(customManager, maxSize, 999'999'999);
+	integrityTestBatch(customManager, maxSize, 999'999'999);
 
 	std::cout << "IntegrityTestSmall" << std::endl;
 	measure(customManager, basicManager, maxSize, integrityTestSmall);
@@ -259,6 +1149,12 @@ int main()
 	std::cout << "IntegrityTestMixed" << std::endl;
 	measure(customManager, basicManager, maxSize, integrityTestMixed);
 
+	std::cout << "IntegrityTestReallocate" << std::endl;
+	measure(customManager, basicManager, maxSize, integrityTestReallocate);
+
+	std::cout << "IntegrityTestBatch" << std::endl;
+	measure(customManager, basicManager, maxSize, integrityTestBatch);
+
 	std::cout << "Integrity Test End" << std::endl;
 
 	std::cout << "Performance Test Start" << std::endl;
@@ -272,8 +1168,62 @@ int main()
 	std::cout << "PerformanceTestHuge" << std::endl;
 	measure(customManager, basicManager, maxSize, performanceTestHuge);
 
+	std::cout << "PerformanceTestHugeFragmented" << std::endl;
+	measure(customManager, basicManager, maxSize, performanceTestHugeFragmented);
+
+	std::cout << "PerformanceTestProducerConsumer" << std::endl;
+	measure(customManager, basicManager, maxSize, performanceTestProducerConsumer);
+
 	std::cout << "PerformanceTestMixed" << std::endl;
 	measure(customManager, basicManager, maxSize, performanceTestMixed);
 
+	std::cout << "PerformanceTestReallocate" << std::endl;
+	measure(customManager, basicManager, maxSize, performanceTestReallocate);
+
+	std::cout << "PerformanceTestBatch" << std::endl;
+	measure(customManager, basicManager, maxSize, performanceTestBatch);
+
+	std::cout << "SizeClassBenchmark" << std::endl;
+	sizeClassBenchmark();
+
+	std::cout << "MixedBenchmark" << std::endl;
+	mixedBenchmark(maxSize);
+
+	std::cout << "TraceTest" << std::endl;
+	traceTest(maxSize);
+
+	std::cout << "ReallocateTierTest" << std::endl;
+	reallocateTierTest();
+
+	std::cout << "SizedFreeTest" << std::endl;
+	sizedFreeTest();
+
+	std::cout << "NumaTest" << std::endl;
+	numaTest();
+
+	std::cout << "RegionTest" << std::endl;
+	regionTest(maxSize);
+
+	std::cout << "BitmapPoolTest" << std::endl;
+	bitmapPoolTest(maxSize);
+
+	std::cout << "PoolUtilizationTest" << std::endl;
+	poolUtilizationTest(maxSize);
+
+	std::cout << "StatsTest" << std::endl;
+	statsTest();
+
+	std::cout << "HeapProfilerTest" << std::endl;
+	heapProfilerTest(maxSize);
+
+	std::cout << "HardeningTest" << std::endl;
+	hardeningTest(maxSize);
+
+	std::cout << "HugePageTest" << std::endl;
+	hugePageTest(maxSize);
+
+	std::cout << "PurgeTest" << std::endl;
+	purgeTest(maxSize);
+
 	std::cout << "Performance Test End" << std::endl;
 }
\ No newline at end of file
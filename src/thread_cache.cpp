@@ -0,0 +1,127 @@
+#include "thread_cache.h"
+
+#include "memory_manager.h"
+
+#include <algorithm>
+
+using namespace CustomMemoryManagerConstants;
+using namespace ThreadCacheConstants;
+
+namespace
+{
+	// the caches of one thread, one per manager
+	// trivially destructible, so that reading it never registers a destructor, which may allocate
+	struct ThreadCacheList
+	{
+		ThreadCache* head;
+		// set while a cache is being created, and once the thread's caches are released
+		bool isCreating;
+		bool isReleased;
+	};
+	thread_local ThreadCacheList threadCaches;
+
+	// releases the thread's caches at thread exit; constructed along with the first cache
+	struct ThreadCacheReleaser
+	{
+		~ThreadCacheReleaser()
+		{
+			ThreadCacheList& list = threadCaches;
+			list.isReleased = true;
+			while (list.head != nullptr)
+			{
+				ThreadCache* cache = list.head;
+				list.head = cache->next;
+				cache->release();
+			}
+		}
+	};
+	thread_local ThreadCacheReleaser threadCacheReleaser;
+}
+
+int ThreadCache::magazineCapacity(size_t blockSize)
+{
+	if (blockSize > MAX_CACHED_BLOCK_SIZE)
+		return 0;
+	return (int)std::min<size_t>(MAX_MAGAZINE_SIZE, MAX_MAGAZINE_BYTES / blockSize);
+}
+
+ThreadCache::ThreadCache(CustomMemoryManager* manager) :
+	manager(manager), next(nullptr), prevOfManager(nullptr), nextOfManager(nullptr), traceBuffer(nullptr)
+{
+	for (int i = 0; i < (int)smallMagazines.size(); i++)
+	{
+		smallMagazines[i].count = 0;
+		smallMagazines[i].capacity = magazineCapacity(SMALL_BLOCK_SIZES[i]);
+	}
+	for (int i = 0; i < (int)largeMagazines.size(); i++)
+	{
+		largeMagazines[i].count = 0;
+		largeMagazines[i].capacity = magazineCapacity(LARGE_BLOCK_SIZES[i]);
+	}
+}
+
+ThreadCache* ThreadCache::get(CustomMemoryManager* manager)
+{
+	ThreadCacheList& list = threadCaches;
+	for (ThreadCache* cache = list.head; cache != nullptr; cache = cache->next)
+	{
+		if (cache->manager == manager)
+			return cache;
+	}
+	// an allocation made while registering the releaser, or by a later thread_local destructor, goes uncached
+	if (list.isCreating || list.isReleased)
+		return nullptr;
+	list.isCreating = true;
+	ThreadCacheReleaser& releaser = threadCacheReleaser;
+	(void)releaser;
+	ThreadCache* cache = manager->allocateThreadCache();
+	cache->next = list.head;
+	list.head = cache;
+	list.isCreating = false;
+	return cache;
+}
+
+void ThreadCache::discard(CustomMemoryManager* manager)
+{
+	ThreadCacheList& list = threadCaches;
+	for (ThreadCache** link = &list.head; *link != nullptr; link = &(*link)->next)
+	{
+		if ((*link)->manager == manager)
+		{
+			*link = (*link)->next;
+			return;
+		}
+	}
+}
+
+void* ThreadCache::refill(Magazine& magazine, bool isSmallPool, int index)
+{
+	// fill half of the magazine so that both allocations and frees have room
+	int count = std::max(1, magazine.capacity / 2);
+	magazine.count = manager->allocateBlocks(isSmallPool, index, magazine.blocks, count);
+	SizeClassCounters::add(magazine.counters.poolAllocations, magazine.count);
+	return magazine.blocks[--magazine.count];
+}
+
+void ThreadCache::flush(Magazine& magazine, bool isSmallPool, int index, int count)
+{
+	// the oldest blocks are at the bottom of the magazine
+	manager->freeBlocks(isSmallPool, index, magazine.blocks, count);
+	SizeClassCounters::add(magazine.counters.poolFrees, count);
+	std::copy(magazine.blocks + count, magazine.blocks + magazine.count, magazine.blocks);
+	magazine.count -= count;
+}
+
+void ThreadCache::flushAll()
+{
+	for (int i = 0; i < (int)smallMagazines.size(); i++)
+		flush(smallMagazines[i], true, i, smallMagazines[i].count);
+	for (int i = 0; i < (int)largeMagazines.size(); i++)
+		flush(largeMagazines[i], false, i, largeMagazines[i].count);
+}
+
+void ThreadCache::release()
+{
+	flushAll();
+	manager->freeThreadCache(this);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+// per-thread magazines in front of the block pools
+// one bounded stack of free blocks per size class, refilled and flushed in batches
+// a thread's caches are flushed back to the block pools when the thread exits
+
+#include "size_classes.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class CustomMemoryManager;
+struct TraceBuffer;
+
+namespace ThreadCacheConstants
+{
+	constexpr int MAX_MAGAZINE_SIZE = 64;
+	// classes with larger blocks bypass the cache
+	constexpr size_t MAX_CACHED_BLOCK_SIZE = 32 * (1 << 10);
+	// upper bound on bytes held by one magazine
+	constexpr size_t MAX_MAGAZINE_BYTES = 256 * (1 << 10);
+}
+
+// events of one size class, read by the statistics from any thread
+// a thread cache's counters are written by its thread alone, so counting takes no atomic read-modify-write
+struct SizeClassCounters
+{
+	std::atomic<uint64_t> allocations{ 0 };
+	std::atomic<uint64_t> frees{ 0 };
+	// blocks taken from and returned to the pools, through a magazine or not
+	std::atomic<uint64_t> poolAllocations{ 0 };
+	std::atomic<uint64_t> poolFrees{ 0 };
+
+	static void add(std::atomic<uint64_t>& counter, uint64_t count)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+	}
+};
+
+class ThreadCache
+{
+	struct Magazine
+	{
+		int count;
+		int capacity;
+		SizeClassCounters counters;
+		void* blocks[ThreadCacheConstants::MAX_MAGAZINE_SIZE];
+	};
+public:
+	CustomMemoryManager* const manager;
+	ThreadCache* next;
+	// links of the manager's list of caches, guarded by its lock
+	ThreadCache* prevOfManager;
+	ThreadCache* nextOfManager;
+	// created on the thread's first traced operation, and written out when the cache is released
+	TraceBuffer* traceBuffer;
+	// frees of blocks whose pages are on another node than the thread's, written as the class counters are
+	std::atomic<uint64_t> crossNodeFrees{ 0 };
+private:
+	std::array<Magazine, CustomMemoryManagerConstants::SMALL_CLASS_COUNT> smallMagazines;
+	std::array<Magazine, CustomMemoryManagerConstants::LARGE_CLASS_COUNT> largeMagazines;
+public:
+	ThreadCache(CustomMemoryManager* manager);
+	// returns the cache of the calling thread for the manager, creating it on first use
+	// nullptr while the cache is being created and after the thread's caches are released
+	static ThreadCache* get(CustomMemoryManager* manager);
+	// drops the calling thread's cache for a manager that is being destroyed
+	// caches of other threads must already be gone, i.e. those threads have exited
+	static void discard(CustomMemoryManager* manager);
+	// blocks a magazine of the class holds, 0 for the classes that are not cached
+	static int magazineCapacity(size_t blockSize);
+
+	// nullptr if the class is not cached
+	void* allocate(bool isSmallPool, int index)
+	{
+		Magazine& magazine = isSmallPool ? smallMagazines[index] : largeMagazines[index];
+		SizeClassCounters::add(magazine.counters.allocations, 1);
+		if (magazine.count > 0)
+			return magazine.blocks[--magazine.count];
+		if (magazine.capacity == 0)
+		{
+			// the caller takes the block from the pools
+			SizeClassCounters::add(magazine.counters.poolAllocations, 1);
+			return nullptr;
+		}
+		return refill(magazine, isSmallPool, index);
+	}
+	// false if the class is not cached
+	bool free(void* ptr, bool isSmallPool, int index)
+	{
+		Magazine& magazine = isSmallPool ? smallMagazines[index] : largeMagazines[index];
+		SizeClassCounters::add(magazine.counters.frees, 1);
+		if (magazine.count == magazine.capacity)
+		{
+			if (magazine.capacity == 0)
+			{
+				SizeClassCounters::add(magazine.counters.poolFrees, 1);
+				return false;
+			}
+			flush(magazine, isSmallPool, index, magazine.capacity / 2);
+		}
+		magazine.blocks[magazine.count++] = ptr;
+		return true;
+	}
+	void flushAll();
+	const SizeClassCounters& counters(bool isSmallPool, int index) const
+	{
+		return isSmallPool ? smallMagazines[index].counters : largeMagazines[index].counters;
+	}
+	// flushes and returns the cache's own memory to the manager
+	void release();
+
+private:
+	void* refill(Magazine& magazine, bool isSmallPool, int index);
+	void flush(Magazine& magazine, bool isSmallPool, int index, int count);
+};
@@ -0,0 +1,111 @@
+#include "trace_recorder.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+using namespace TraceConstants;
+
+namespace
+{
+	std::atomic<uint32_t> nextThread{ 1 };
+	// trivially destructible, as the thread caches are
+	thread_local uint32_t threadNumber;
+
+	uint64_t nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	std::FILE* openTrace(const char* path)
+	{
+		if (path == nullptr)
+			return nullptr;
+		std::FILE* file = std::fopen(path, "wb");
+		if (file == nullptr)
+			return nullptr;
+		std::setvbuf(file, nullptr, _IONBF, 0);
+		std::fwrite(MAGIC, sizeof(MAGIC), 1, file);
+		return file;
+	}
+}
+
+TraceBuffer::TraceBuffer() :
+	thread(TraceRecorder::currentThread()), count(0)
+{
+}
+
+TraceRecorder::TraceRecorder(const char* path) :
+	file(openTrace(path)), start(nowNs())
+{
+}
+
+TraceRecorder::~TraceRecorder()
+{
+	if (file != nullptr)
+		std::fclose(file);
+}
+
+uint32_t TraceRecorder::currentThread()
+{
+	if (threadNumber == 0)
+		threadNumber = nextThread.fetch_add(1, std::memory_order_relaxed);
+	return threadNumber;
+}
+
+TraceEvent TraceRecorder::makeEvent(TraceOp op, void* ptr, uint64_t argument, size_t size) const
+{
+	return TraceEvent{ nowNs() - start, (uint64_t)ptr, argument, (size & SIZE_MASK) | (uint64_t)op << OP_SHIFT };
+}
+
+void TraceRecorder::recordUnbuffered(const TraceEvent& event)
+{
+	write(currentThread(), &event, 1);
+}
+
+void TraceRecorder::flush(TraceBuffer& buffer)
+{
+	write(buffer.thread, buffer.events, buffer.count);
+	buffer.count = 0;
+}
+
+void TraceRecorder::write(uint32_t thread, const TraceEvent* events, int count)
+{
+	if (count == 0)
+		return;
+	TraceChunkHeader header{ thread, (uint32_t)count };
+	std::lock_guard<std::mutex> lock(mutex);
+	std::fwrite(&header, sizeof(header), 1, file);
+	std::fwrite(events, sizeof(TraceEvent), count, file);
+}
+
+bool readTrace(const char* path, Trace& trace)
+{
+	std::FILE* file = std::fopen(path, "rb");
+	if (file == nullptr)
+		return false;
+	char magic[sizeof(MAGIC)];
+	if (std::fread(magic, sizeof(magic), 1, file) != 1 || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+	{
+		std::fclose(file);
+		return false;
+	}
+	trace.threads.clear();
+	std::unordered_map<uint32_t, size_t> indices;
+	TraceChunkHeader header;
+	// a recording cut short ends in a partial chunk, of which the whole events are kept
+	while (std::fread(&header, sizeof(header), 1, file) == 1)
+	{
+		auto found = indices.emplace(header.thread, trace.threads.size());
+		if (found.second)
+			trace.threads.emplace_back();
+		std::vector<TraceEvent>& events = trace.threads[found.first->second];
+		const size_t from = events.size();
+		events.resize(from + header.count);
+		const size_t read = std::fread(events.data() + from, sizeof(TraceEvent), header.count, file);
+		events.resize(from + read);
+	}
+	std::fclose(file);
+	return true;
+}
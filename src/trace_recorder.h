@@ -0,0 +1,98 @@
+#pragma once
+
+// allocation traces, recorded by CustomMemoryManager with CustomMemoryManagerConfig::tracePath
+// and played back against any MemoryManager by replayTrace in benchmark.h
+// the file is TraceConstants::MAGIC followed by chunks, each a TraceChunkHeader and its events
+// a thread's chunks are in order; the chunks of different threads interleave as they were written
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace TraceConstants
+{
+	constexpr char MAGIC[8] = { 'M', 'M', 'T', 'R', 'A', 'C', 'E', '1' };
+	// events a thread buffers before writing them out
+	constexpr int BUFFER_EVENTS = 512;
+	constexpr int OP_SHIFT = 56;
+	constexpr uint64_t SIZE_MASK = ((uint64_t)1 << OP_SHIFT) - 1;
+}
+
+enum class TraceOp : uint8_t
+{
+	ALLOCATE, ALLOCATE_ALIGNED, FREE, FREE_SIZED, REALLOCATE,
+};
+
+// allocations are stamped once they have their block and frees before they give it up,
+// so that in timestamp order an address is always freed before it is handed out again
+struct TraceEvent
+{
+	// nanoseconds since the recording started
+	uint64_t timestamp;
+	// address of the block, 0 for none; an address stands for the block until it is freed
+	uint64_t id;
+	// the alignment of ALLOCATE_ALIGNED and the block before of REALLOCATE
+	uint64_t argument;
+	// the size in the low OP_SHIFT bits, under the TraceOp
+	uint64_t sizeAndOp;
+
+	TraceOp op() const { return (TraceOp)(sizeAndOp >> TraceConstants::OP_SHIFT); }
+	size_t size() const { return (size_t)(sizeAndOp & TraceConstants::SIZE_MASK); }
+};
+static_assert(sizeof(TraceEvent) == 32, "trace events are written as they are");
+
+struct TraceChunkHeader
+{
+	uint32_t thread;
+	uint32_t count;
+};
+
+// events of one thread not written out yet, kept by its thread cache
+struct TraceBuffer
+{
+	uint32_t thread;
+	int count;
+	TraceEvent events[TraceConstants::BUFFER_EVENTS];
+
+	TraceBuffer();
+};
+
+// writes the events of a manager's threads to its file, a chunk at a time under the lock
+// the file is unbuffered, so that writing never allocates
+class TraceRecorder
+{
+	std::FILE* const file;
+	std::mutex mutex;
+	const uint64_t start;
+public:
+	// path == nullptr, or a file that cannot be opened, records nothing
+	TraceRecorder(const char* path);
+	~TraceRecorder();
+	bool isRecording() const { return file != nullptr; }
+	// numbered from 1 in the order the threads first record
+	static uint32_t currentThread();
+	TraceEvent makeEvent(TraceOp op, void* ptr, uint64_t argument, size_t size) const;
+	void record(TraceBuffer& buffer, const TraceEvent& event)
+	{
+		buffer.events[buffer.count++] = event;
+		if (buffer.count == TraceConstants::BUFFER_EVENTS)
+			flush(buffer);
+	}
+	// for the threads without a buffer
+	void recordUnbuffered(const TraceEvent& event);
+	void flush(TraceBuffer& buffer);
+
+private:
+	void write(uint32_t thread, const TraceEvent* events, int count);
+};
+
+// the events of a trace by thread, each thread's in order
+struct Trace
+{
+	std::vector<std::vector<TraceEvent>> threads;
+};
+
+// false if the file cannot be read or is not a trace
+bool readTrace(const char* path, Trace& trace);